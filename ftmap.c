@@ -48,6 +48,33 @@
 * Extend max objects to 20K and classes to 500
 * Tidied compiler warnings
 *
+* 17-Oct-2026 agent
+* Grid indexed clash box manager, no limit on the number of clash boxes
+* Summed area occupancy raster clash scoring use -s option
+* Label positions computed once per radius and text size and reused
+* Branch and bound label search use -k option
+* Labels placed in independent clusters on several threads use -j option
+* Clash boxes stored as edge arrays and scored 8 at a time with SSE2/AVX2
+* Label placement to a time budget with local search use --label-budget-ms
+* Label positions kept from turn to turn in a layout file use --layout
+* Game object images clash by their pixel masks not their bounding squares
+* Leaders, courses and grid lines clash as thick segments not bounding boxes
+* Title and legend placed where they clash least, coarse to fine
+* Sprites rotated by fixed point stepping, check with --check-spin
+* Only headings 0 to 2 resampled, the rest are exact quarter turns
+* Sprites prepared on several threads with the -j option
+* Only the classes and headings a map shows are read and rotated
+* Rotated sprites kept between runs with the --sprite-cache option
+* Sprite packs made by ftmap-prep, used with the -p option
+* Sprite resampling summed 8 pixels at a time by SSE2 or AVX2 kernels
+* Sprites trimmed to their opaque pixels, drawn and faded by that rectangle
+* Classes with the same gif content and scale share one set of sprites
+* Real Thrust facings drawn to the nearest --angle-bucket degrees
+* Sprites at half scale or less spun from a box filtered mip pyramid level
+* Game object images recolored by palette entry instead of pixel by pixel
+* Sprite foregrounds recolored once before drawing, not for every game object
+* Optional game object tint drawn through palette remaps cached per sprite
+*
 ******************************************************************************
 */
 
@@ -63,6 +90,24 @@
 #include <math.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(NO_SIMD)
+#define BOX_SIMD
+#include <immintrin.h>
+#endif
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE
+#endif
 #include "gd.h"
 #include "gdfontt.h"
 #include "gdfonts.h"
@@ -105,11 +150,40 @@
 #define MAX_BUFFER		 1024       /* max line length in file reading */
 #define MAX_CLASSES      500   		/* game_object classes */
 #define MAX_OBJECTS      20000 		/* objects on map */
-#define MAX_BOXES        1000  		/* clash boxes */
+#define BOX_CELL_SHIFT   5     		/* clash grid cell size 32 pixels */
+#define BOX_LIST_BLOCK   8     		/* clash box list growth block, SIMD width */
+#define BOX_ALIGN        32    		/* clash box array alignment in bytes */
+#define BOX_FIRST_COL    1     		/* cell is first column of box */
+#define BOX_FIRST_ROW    2     		/* cell is first row of box */
+#define RASTER_TILE_SHIFT 6    		/* occupancy raster tile size 64 pixels */
+#define RASTER_TILE      (1 << RASTER_TILE_SHIFT)
+#define SPIN_SHIFT       32    		/* fraction bits stepping sprite rotation */
+#define SPIN_HALF        ((int64_t) 1 << (SPIN_SHIFT - 1))
+#define SPIN_SAMPLES     25    		/* 5x5 probes per pixel resampling */
+#define SPIN_PROBES      5     		/* probes across a pixel resampling */
+#define SPIN_MIP_PROBES  3     		/* and across a mip level pixel */
+#define SPIN_MIP_SCALE   0.5   		/* scales spun from a mip level */
+#define SPIN_TIE         1e-6  		/* rotation rounding tie tolerance */
+#define SPIN_LANES       8     		/* pixels resampled at once down a column */
+#define SPIN_PLANE_MAX   (1 << 24)	/* largest color plane resampled by SIMD */
+#define SPRITE_CACHE_VERSION 3 		/* sprite cache format and kernel version */
+#define SPRITE_CACHE_MAGIC "FTSC"	/* sprite cache file signature */
+#define SPRITE_CACHE_SIDE 4096  	/* largest cached image side believed */
+#define SPRITE_CACHE_BASIS 0xcbf29ce484222325ULL  /* FNV-1a 64 bit offset basis */
+#define SPRITE_CACHE_PRIME 0x100000001b3ULL       /* FNV-1a 64 bit prime */
+#define PACK_VERSION     3     		/* sprite pack format and kernel version */
+#define PACK_MAGIC       "FTPK"		/* sprite pack file signature */
+#define PACK_ALIGN(N)    (((N) + 7) & ~(size_t) 7) /* pack section boundary */
+#define MAX_POLYGON      16    		/* vertices of a clipped segment */
 #define MAX_LEADER       32    		/* leader line length */
 #define MAX_SHIFTS       1000  		/* attempts to place text block */
+#define PLACE_STEP       32    		/* coarse anchor spacing placing blocks */
+#define PLACE_KEEP       8     		/* coarse anchors refined placing blocks */
+#define LEGEND_MARGIN    15    		/* legend distance from the map side */
+#define LEGEND_TOP       30    		/* legend distance from the map top */
 #define MIN_RADIUS       0.0001 	/* size below which radius size is 0 */
 #define ANNO_ANGLE       1    		/* search step rotation in degrees */
+#define ANNO_ANCHORS     8    		/* classic label positions tried first */
 #define LEADER_WEIGHTING 0.3  		/* weighting factor for leader line clashing */ 
 #define LINE_DILATION    4    		/* clash box dilation in pixels */
 #define TEXT_DILATION    2    		/* clash box dilation in pixels */
@@ -119,6 +193,8 @@
 #define TITLE_FADE       50   		/* 50% fade under title */
 #define LEGEND_FADE      50   		/* 50% fade under legend */
 #define NOT_DEFINED      999  		/* GIF color not defined */
+#define NO_TINT          -1   		/* game object drawn without a tint */
+#define MAX_TINTS        64   		/* tints given map palette colors */
 #define COL_BLK_SIZE     500  		/* Color block size */  
 #define GIF_PALETTE_SIZE 256  		/* GIF image palette size */ 
 #define RESERVED_COLORS  12   		/* Reserved Colors */
@@ -149,6 +225,201 @@ typedef struct box {
     int max_y;
 } Box;
 
+typedef struct mask {
+    int x,                      /* covered area top left in the image */
+        y;
+    int w,                      /* size of covered area in pixels */
+        h;
+    int words;                  /* 64 bit words per row */
+    uint64_t *bits;             /* rows of pixel bits, x is bit x % 64 of */
+} Mask;                         /* word x / 64 */
+
+typedef struct maskref {
+    Mask *mask;
+    int x,                      /* pixel position of mask top left */
+        y;
+    int flags;                  /* BOX_FIRST_COL/ROW for the grid cell */
+} MaskRef;
+
+typedef struct masklist {
+    MaskRef *ref;               /* masks, grown as required */
+    int num;
+    int max;
+} MaskList;
+
+typedef struct segment {
+    Line line;                  /* centre line of the segment */
+    int thickness;              /* half width, the ends stick out as much */
+    Box bounds;                 /* pixels the segment can touch */
+    int orthogonal;             /* segment is its bounds */
+    double corner_x[4];         /* corners of the segment rectangle in order */
+    double corner_y[4];
+    double area;
+    int flags;                  /* first column or row in the clash grid */
+} Segment;
+
+typedef struct segmentlist {
+    Segment *segment;           /* segments, grown as required */
+    int num;
+    int max;
+} SegmentList;
+
+typedef struct remap {
+    int tint;                   /* packed rgb tint the table is for */
+    int color[gdMaxColors];     /* map color of each sprite palette entry */
+    struct remap *next;
+} Remap;
+
+typedef struct sprite {
+    gdImagePtr image;           /* game object image at one heading, trimmed */
+    Mask *mask;                 /* to its opaque pixels, which the mask */
+    int off_x,                  /* covers, and its top left from the game */
+        off_y;                  /* object centre */
+    int foreground;             /* map color its foreground was changed to */
+    Remap *remap;               /* tint remaps, built the first time used */
+} Sprite;
+
+typedef struct annocandidate {
+    Box text;                   /* text box relative to game object centre */
+    Box leader;                 /* leader line box relative to centre */
+} AnnoCandidate;
+
+typedef struct annoring {
+    int radius;                 /* game object radius search starts at */
+    int text_width;
+    int text_height;
+    int num;
+    AnnoCandidate *candidate;   /* unique positions in search order */
+    int *anchor_order;          /* candidates with the 8 anchors first */
+    struct annoring *next;
+} AnnoRing;
+
+typedef struct label {
+    int game_object;            /* game object labelled */
+    AnnoRing *ring;             /* candidate positions for the label */
+    Box extent;                 /* area the label search can touch */
+    Point position;             /* top left of label text */
+    int candidate;              /* ring candidate used, -1 for none */
+    int warm;                   /* candidate from the layout file, -1 for none */
+    int warm_clash;             /* clash of the candidate in the last layout */
+    int clash;                  /* clash when placed */
+    int cluster;                /* union find parent label */
+} Label;
+
+typedef struct layoutentry {
+    char *name;                 /* game object name */
+    int dx,                     /* label text top left from object centre */
+        dy;
+    int clash;                  /* clash of the label when placed */
+    int order;                  /* line in the layout file */
+    int used;                   /* matched to a label */
+} LayoutEntry;
+
+typedef struct spin {
+    int out_l;                  /* output image side */
+    int out_xcen;               /* output and input image centres */
+    int out_ycen;
+    int in_xcen;
+    int in_ycen;
+    double cos_s;               /* cos and sin of the angle over the scale */
+    double sin_s;
+    int num_samples;            /* probes per output pixel */
+    double probe_x[SPIN_SAMPLES];   /* probe offsets in the output image */
+    double probe_y[SPIN_SAMPLES];
+    int64_t offset_x[SPIN_SAMPLES]; /* probe offsets in the input image */
+    int64_t offset_y[SPIN_SAMPLES];
+    int64_t step_x;             /* input step for one pixel down a column */
+    int64_t step_y;
+    gdImagePtr im_in;           /* image being rotated */
+    struct spinplane *plane;    /* its color plane, NULL for scalar only */
+} Spin;
+
+typedef struct spinplane {
+    uint32_t *pixel;            /* packed red, green, blue and 1 if inside */
+    int stride;                 /* plane pixels per column */
+    int pad_x,                  /* plane position of input pixel 0,0 */
+        pad_y;
+} SpinPlane;
+
+typedef struct spinsums {
+    int red[SPIN_LANES];        /* probe color sums for pixels down a */
+    int green[SPIN_LANES];      /* column */
+    int blue[SPIN_LANES];
+    int count[SPIN_LANES];      /* probes inside the input image */
+} SpinSums;
+
+typedef struct labeljobs {
+    Label *label;
+    int *member;                /* labels grouped by cluster in object order */
+    int *first;                 /* first member of each cluster */
+    int *cluster;               /* clusters in job order, biggest first */
+} LabelJobs;
+
+typedef struct spritejobs {
+    gdImagePtr source[MAX_CLASSES];     /* decoded and recolored class images */
+    gdImagePtr level[MAX_CLASSES];      /* their mip levels sprites spin from */
+    double scale[MAX_CLASSES];          /* class scales for the levels */
+    int across[MAX_CLASSES];            /* resampling probes across a pixel */
+    SpinPlane plane[MAX_CLASSES];       /* color planes of the levels */
+    uint64_t key[MAX_CLASSES];          /* sprite cache keys */
+    int cached[MAX_CLASSES];            /* class sprites read from the cache */
+    int differ[MAX_CLASSES * 3];        /* --check-spin counts per job */
+    int probes[MAX_CLASSES * 3];
+    int ties[MAX_CLASSES * 3];
+    int kernel[MAX_CLASSES * 3];        /* pixels the SIMD kernel differs */
+    int *bucket;                        /* class and bucket of each facing */
+} SpriteJobs;
+
+typedef struct jobqueue {
+    void (*run)(int job, void *arg);
+    void *arg;
+    int num_jobs;
+    int next_job;
+    pthread_mutex_t lock;
+} JobQueue;
+
+typedef struct boxlist {
+    int *min_x;                 /* box edges in separate aligned arrays, */
+    int *min_y;                 /* slots past num hold empty boxes */
+    int *max_x;
+    int *max_y;
+    int *flags;                 /* BOX_FIRST_COL/ROW for the grid cell */
+    void *block;                /* allocation holding the arrays */
+    int num;
+    int max;
+} BoxList;
+
+typedef struct boxgrid {
+    int min_x,                  /* pixel origin of cell 0,0 */
+        min_y;
+    int cols,
+        rows;
+    BoxList *cell;              /* boxes touching each cell */
+    MaskList *masks;            /* masks touching each cell */
+    SegmentList *segments;      /* segments touching each cell */
+} BoxGrid;
+
+typedef struct rastertile {
+    unsigned int *count;        /* per pixel box count, NULL if empty */
+    unsigned int *sum;          /* summed area table of the counts */
+    int dirty;                  /* counts changed since table summed */
+} RasterTile;
+
+typedef struct raster {
+    int min_x,                  /* pixel origin of the raster */
+        min_y;
+    int w,
+        h;
+    int cols,
+        rows;
+    RasterTile *tile;
+} Raster;
+
+typedef struct boxindex {
+    BoxGrid grid;               /* clash boxes by grid cell */
+    Raster raster;              /* or box counts per pixel if summed_area */
+} BoxIndex;
+
 typedef struct gameobject {
     char *name;
     double x,
@@ -157,12 +428,74 @@ typedef struct gameobject {
     int heading,
         facing;  
     int delta_heading;          /* +ve=Stbd -ve=Port */
-    gdImagePtr image[12];
+    Sprite *sprite[12];         /* only headings in use are made */
+    Sprite *face;               /* sprite at its facing */
+    int tint;                   /* packed rgb tint, NO_TINT if drawn as is */
     int radius;
     int cen_x,
         cen_y;
+    int class_num;              /* class of a game object, -1 if unknown */
 } GameObject;
 
+typedef struct colorcount {
+    unsigned char r,            /* color of one image palette entry */
+                  g,
+                  b,
+                  unused;
+    int32_t count;              /* pixels of the color in the image */
+} ColorCount;
+
+typedef struct packheader {
+    char magic[4];              /* PACK_MAGIC */
+    int32_t version;            /* PACK_VERSION */
+    int32_t resample;           /* settings the sprites were made with */
+    int32_t color;
+    int32_t foreground[3];
+    int32_t num_classes;        /* entries in the class index that follows */
+} PackHeader;
+
+typedef struct packclass {
+    int32_t name;               /* pack offsets of the class name, */
+    int32_t colors;             /* its counted colors */
+    int32_t heading[12];        /* and its sprite at each heading */
+    int32_t num_colors;
+    int32_t radius;
+    double scale;
+} PackClass;
+
+typedef struct packimage {
+    int32_t sx,                 /* image size */
+            sy;
+    int32_t colors_total;       /* palette entries and transparent color */
+    int32_t transparent;
+    int32_t mask_x,             /* opaque area of the clash mask */
+            mask_y,
+            mask_w,
+            mask_h;
+    int32_t mask_words;         /* 64 bit mask words per row */
+    int32_t off_x,              /* image top left from the object centre */
+            off_y;
+    int32_t unused;
+    unsigned char palette[gdMaxColors][4]; /* red, green, blue and open */
+} PackImage;                    /* followed by the pixel columns, padded, */
+                                /* then the mask bits */
+typedef struct pack {
+    char *data;                 /* the pack file mapped in memory */
+    size_t size;
+    PackHeader *header;
+    PackClass *class;           /* class index sorted by name */
+} Pack;
+
+typedef struct classimage {
+    char *filename;             /* game object gif */
+    double scale;
+    int used;                   /* a game object or the legend shows it */
+    ColorCount *colors;         /* colors in the order the image first uses */
+    int num_colors;
+    Sprite **bucket;            /* Real Thrust facings off the clock headings */
+    int same_as;                /* earlier class with the same gif content */
+} ClassImage;                   /* and scale sharing its sprites, or -1 */
+
 typedef struct colorentry {
  int r,g,b;            /* RGB values of required color */
 } ColorEntry;
@@ -192,6 +525,7 @@ gdImagePtr im_out     =NULL;
 gdImagePtr background =NULL;
 
 GameObject class[MAX_CLASSES];
+ClassImage class_image[MAX_CLASSES];
 GameObject game_objects[MAX_OBJECTS];
 
 double min_x        =0.0;
@@ -223,6 +557,20 @@ int grid        =0;
 int resample    =0;
 int real_thrust =0;
 int wallpaper   =0;
+int summed_area =0;
+int bound_search=0;
+int good_overlap=0;
+int num_threads =1;
+int num_buckets =72;            /* Real Thrust facings per turn */
+int label_budget=0;
+int check_spin  =0;
+int spin_differ =0;
+int spin_probes =0;
+int spin_ties   =0;
+int spin_kernel_differ=0;
+int spin_pixels =0;
+int spin_tie_pixels=0;
+static double label_deadline = 0.0;
 
 /* color indexes default impossible value
  */
@@ -249,6 +597,10 @@ char *image_dir         =NULL;
 char *title             =NULL;
 char *gif_filename      =NULL;
 char *resource_filename =NULL;
+char *layout_filename   =NULL;
+char *sprite_cache_dir  =NULL;
+char *pack_filename     =NULL;
+Pack *sprite_pack       =NULL;
 
 int out_x =0;
 int out_y =0;  
@@ -261,9 +613,10 @@ FILE *in_file=NULL;
  ******************
  */
 
-static int num_boxes =0;
-static Box clash_box[MAX_BOXES];
+static BoxList clash_boxes = { NULL, NULL, NULL, NULL, NULL, NULL, 0, 0 };
+static BoxIndex clash_index;
 static Palette palette;
+static AnnoRing *anno_rings =NULL;
 
 /* Color tree
  */
@@ -306,11 +659,11 @@ static Node* createNode (int nLevel, int nColorBits, int* pLeafCount, Node** pRe
 
 /* addColor
 ------------------------------------------------------------------------------
-Add a color to the color quantization octree
+Add nCount pixels of a color to the color quantization octree
 
 */
-static void addColor (Node** ppNode, int r, int g, int b, int nColorBits,
-    int nLevel, int* pLeafCount, Node** pReducibleNodes)
+static void addColor (Node** ppNode, int r, int g, int b, int nCount, 
+    int nColorBits, int nLevel, int* pLeafCount, Node** pReducibleNodes)
 {
     int nIndex, shift;
     static int mask[8] = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
@@ -323,10 +676,10 @@ static void addColor (Node** ppNode, int r, int g, int b, int nColorBits,
 
     // Update color information if it's a leaf node
     if ((*ppNode)->bIsLeaf) {
-        (*ppNode)->nPixelCount++;
-        (*ppNode)->nRedSum    += r;
-        (*ppNode)->nGreenSum  += g;
-        (*ppNode)->nBlueSum   += b;
+        (*ppNode)->nPixelCount += nCount;
+        (*ppNode)->nRedSum    += r * nCount;
+        (*ppNode)->nGreenSum  += g * nCount;
+        (*ppNode)->nBlueSum   += b * nCount;
     }
 
     // Recurse a level deeper if the node is not a leaf
@@ -335,7 +688,7 @@ static void addColor (Node** ppNode, int r, int g, int b, int nColorBits,
         nIndex = (((r & mask[nLevel]) >> shift) << 2) |
                  (((g & mask[nLevel]) >> shift) << 1) |
                   ((b & mask[nLevel]) >> shift);
-        addColor (&((*ppNode)->pChild[nIndex]), r, g, b, nColorBits,
+        addColor (&((*ppNode)->pChild[nIndex]), r, g, b, nCount, nColorBits,
             nLevel + 1, pLeafCount, pReducibleNodes);
     }
 }
@@ -453,7 +806,7 @@ void ColorMgr_getImageColorMap( gdImagePtr im , int nMaxColors)
             b = gdImageBlue(im, im_color);
             g = gdImageGreen(im, im_color);
             r = gdImageRed(im, im_color);
-            addColor (&pTree, r, g, b, nColorBits, 0, &nLeafCount, pReducibleNodes);
+            addColor (&pTree, r, g, b, 1, nColorBits, 0, &nLeafCount, pReducibleNodes);
             while (nLeafCount > nMaxColors)
                     reduceTree (nColorBits, &nLeafCount, pReducibleNodes);
         }
@@ -461,6 +814,60 @@ void ColorMgr_getImageColorMap( gdImagePtr im , int nMaxColors)
 }
 
 
+/* ColorMgr_countImageColors
+------------------------------------------------------------------------------
+Count the colors of an image in the order its pixels first use them, 
+scanning as ColorMgr_getImageColorMap does. Returns the number of colors
+
+*/
+int ColorMgr_countImageColors( gdImagePtr im, ColorCount *counts )
+{
+    int first[gdMaxColors];
+    int num_counts = 0;
+    int im_color;
+    int x,y;
+
+    for (im_color = 0; im_color < gdMaxColors; im_color++) {
+        first[im_color] = -1;
+    }
+    for ( x=0 ; x < im->sx ; x++ ) {
+        for ( y=0 ; y < im->sy ; y++ ) { 
+            im_color = gdImageGetPixel(im,x,y);
+            if (first[im_color] == -1) {
+                first[im_color] = num_counts;
+                counts[num_counts].r = gdImageRed(im, im_color);
+                counts[num_counts].g = gdImageGreen(im, im_color);
+                counts[num_counts].b = gdImageBlue(im, im_color);
+                counts[num_counts].unused = 0;
+                counts[num_counts].count = 0;
+                num_counts++;
+            }
+            counts[first[im_color]].count++;
+        }
+    }
+    return num_counts;
+}
+
+/* ColorMgr_addColorCounts
+------------------------------------------------------------------------------
+Load color map from counted image colors. The tree only grows or reduces 
+when a color is first met, later pixels of the color just add to its sums, 
+so this builds the same tree as ColorMgr_getImageColorMap on the image
+
+*/
+void ColorMgr_addColorCounts( ColorCount *counts, int num_counts, int nMaxColors)
+{
+    int nColorBits=8;
+    int c;
+
+    for (c = 0; c < num_counts; c++) {
+        addColor (&pTree, counts[c].r, counts[c].g, counts[c].b, counts[c].count,
+                  nColorBits, 0, &nLeafCount, pReducibleNodes);
+        while (nLeafCount > nMaxColors)
+                reduceTree (nColorBits, &nLeafCount, pReducibleNodes);
+    }
+}
+
 /* ColorMgr_allocateImageColors
 ------------------------------------------------------------------------------
 Allocate quantized colors in image
@@ -503,6 +910,89 @@ static double Rint( double in )
 
 
 
+/* Jobs_worker
+------------------------------------------------------------------------------
+Worker thread, take jobs from the queue until it is empty
+
+*/
+static void *Jobs_worker(void *arg)
+{
+    JobQueue *queue = (JobQueue *) arg;
+    int job;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        job = queue->next_job++;
+        pthread_mutex_unlock(&queue->lock);
+        if (job >= queue->num_jobs) {
+            break;
+        }
+        queue->run(job, queue->arg);
+    }
+    return NULL;
+}
+
+
+/* Jobs_run
+------------------------------------------------------------------------------
+Run independent jobs 0..num_jobs-1 on up to num_threads threads, the calling
+thread takes jobs too. Returns when every job is done
+
+*/
+void Jobs_run(int num_jobs, void (*run)(int job, void *arg), void *arg)
+{
+    JobQueue queue;
+    pthread_t *thread;
+    int num_workers;
+    int i;
+
+    num_workers = MIN(num_threads, num_jobs) - 1;
+    if (num_workers <= 0) {
+        for (i = 0; i < num_jobs; i++) {
+            run(i, arg);
+        }
+        return;
+    }
+
+    queue.run = run;
+    queue.arg = arg;
+    queue.num_jobs = num_jobs;
+    queue.next_job = 0;
+    pthread_mutex_init(&queue.lock, NULL);
+    thread = (pthread_t *) malloc(num_workers * sizeof (pthread_t));
+    for (i = 0; i < num_workers; i++) {
+        if (pthread_create(&thread[i], NULL, Jobs_worker, &queue) != 0) {
+            break;
+        }
+    }
+    num_workers = i;
+    Jobs_worker(&queue);
+    for (i = 0; i < num_workers; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    free(thread);
+    pthread_mutex_destroy(&queue.lock);
+}
+
+
+/* Clock_ms
+------------------------------------------------------------------------------
+Get wall clock time in milliseconds from an arbitrary start, for time budgets
+
+*/
+double Clock_ms(void)
+{
+#ifdef WIN32
+    return clock() * 1000.0 / CLOCKS_PER_SEC;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+#endif
+}
+
+
 /* distance
 ------------------------------------------------------------------------------
 Calculate integer distance between two points
@@ -539,7 +1029,7 @@ Get number of boxes
 */
 int BoxMgr_numberBoxes(void)
 {
-   return num_boxes;   
+   return clash_boxes.num;   
 }
 
 
@@ -621,6 +1111,22 @@ Box Box_dilate(Box bin, int d)
 }
 
 
+/*
+------------------------------------------------------------------------------
+Translate Box by dx,dy
+
+*/
+Box Box_translate(Box bin, int dx, int dy)
+{
+    Box bout;
+    bout.min_x = bin.min_x + dx;
+    bout.min_y = bin.min_y + dy;
+    bout.max_x = bin.max_x + dx;
+    bout.max_y = bin.max_y + dy;
+    return bout;
+}
+
+
 /*
 ------------------------------------------------------------------------------
 Get corner of box closest to a given point
@@ -711,1572 +1217,5973 @@ int Box_overlap(Box box1, Box box2)
     }
 }
 
-/*
+/* Box_union
 ------------------------------------------------------------------------------
-Add box to box manager
+Get the smallest box holding two boxes
 
 */
-void BoxMgr_add(Box box)
+Box Box_union(Box box1, Box box2)
 {
-   clash_box[num_boxes++] = box;
+    Box bout;
+
+    bout.min_x = MIN(box1.min_x, box2.min_x);
+    bout.min_y = MIN(box1.min_y, box2.min_y);
+    bout.max_x = MAX(box1.max_x, box2.max_x);
+    bout.max_y = MAX(box1.max_y, box2.max_y);
+    return bout;
 }
 
 
 /*
 ------------------------------------------------------------------------------
-Draw boxes in box manager
+Grow a box list. The edge arrays share one block, each aligned for SIMD loads
+and a whole number of SIMD blocks long with the unused slots zeroed, an empty
+box never overlaps anything so the kernels can run past the last box
 
 */
-void BoxMgr_draw(gdImagePtr im)
+static void BoxList_grow(BoxList *list)
 {
-   int i;
-
-   for (i=0; i < num_boxes; i++) {
-       Box_draw(clash_box[i],im);
-   }
+    int max;
+    char *block;
+    int *base;
+
+    max = list->max ? list->max * 2 : BOX_LIST_BLOCK;
+    block = (char *) calloc(5 * max * sizeof (int) + BOX_ALIGN, 1);
+    if (block == NULL) {
+        fprintf(stderr,"**** Error out of memory for clash boxes\n**** Aborting\n");
+        exit(1);
+    }
+    base = (int *) (block + (BOX_ALIGN - (size_t) block % BOX_ALIGN) % BOX_ALIGN);
+    if (list->num > 0) {
+        memcpy(base, list->min_x, list->num * sizeof (int));
+        memcpy(base + max, list->min_y, list->num * sizeof (int));
+        memcpy(base + 2 * max, list->max_x, list->num * sizeof (int));
+        memcpy(base + 3 * max, list->max_y, list->num * sizeof (int));
+        memcpy(base + 4 * max, list->flags, list->num * sizeof (int));
+    }
+    free(list->block);
+    list->block = block;
+    list->min_x = base;
+    list->min_y = base + max;
+    list->max_x = base + 2 * max;
+    list->max_y = base + 3 * max;
+    list->flags = base + 4 * max;
+    list->max = max;
 }
 
 
 /*
 ------------------------------------------------------------------------------
-Get specified box from box manager 
+Append box to a box list growing it as required
 
 */
-Box BoxMgr_get(int box_number)
+static void BoxList_add(BoxList *list, Box box, int flags)
 {
-   return clash_box[box_number];   
+    if (list->num == list->max) {
+        BoxList_grow(list);
+    }
+    list->min_x[list->num] = box.min_x;
+    list->min_y[list->num] = box.min_y;
+    list->max_x[list->num] = box.max_x;
+    list->max_y[list->num] = box.max_y;
+    list->flags[list->num] = flags;
+    list->num++;
 }
 
+
 /*
 ------------------------------------------------------------------------------
-Change colors in an image, useful for coloring an image or inverting it
+Get box from a box list
 
 */
-void changeColor(gdImagePtr im, int from_color, int to_color, int swap) 
+static Box BoxList_get(BoxList *list, int i)
 {
-    int x,y,color,fr,fg,fb,tr,tg,tb,pr,pg,pb;
-    
-    /* swap color not on index but rgb values
-     */
-    fr = gdImageRed(im, from_color);
-    fg = gdImageGreen(im,from_color);
-    fb = gdImageBlue(im,from_color);
-    tr = gdImageRed(im, to_color);
-    tg = gdImageGreen(im,to_color);
-    tb = gdImageBlue(im,to_color);
-    for (x=0; x<=im->sx; x++) {
-        for (y=0; y<=im->sy; y++) {
-            color = gdImageGetPixel(im,x,y);
-            pr = gdImageRed(im, color);
-            pg = gdImageGreen(im,color);
-            pb = gdImageBlue(im,color);
-
-            if (pr == fr && pg == fg && pb == fb ) {
-                gdImageSetPixel(im,x,y,to_color); 
-			}else if (swap && pr == tr && pg == tg && pb == tb) {
-                gdImageSetPixel(im,x,y,from_color);          
-			}
-		}
-	}
+    return Box_boxInt(list->min_x[i], list->min_y[i], 
+                      list->max_x[i], list->max_y[i]);
 }
 
 
-/* changeForeground
+/*
 ------------------------------------------------------------------------------
-Change image foreground color - assumes the foreground is white
+Remove a box from a box list, the last box fills the gap and its old slot is
+emptied
+
+Return:
+ true  - box removed
+ false - box not in list
 
 */
-		
-void changeForeground(gdImagePtr im)
+static int BoxList_remove(BoxList *list, Box box, int flags)
 {
-	int r;
-	int g;
-	int b;
-	int new_f;
-	int old_f;
-	
-	if (verbose) printf("Changing foreground colour\n");
-
-	/* get foreground color and get best match in image
-	 */
-	r = gdImageRed(im_out,foreground_color);
-	g = gdImageGreen(im_out,foreground_color);
-	b = gdImageBlue(im_out,foreground_color);
-
-	new_f = gdImageColorExact(im,r,g,b);
-	if (new_f == -1) {
-		new_f = gdImageColorAllocate(im,r,g,b);
-		if (new_f == -1) {
-			new_f = gdImageColorClosest(im,r,g,b);
-		}
-	}
-	/* get old foreground color (white)  best match in image
-	 */
-	old_f = gdImageColorExact(im,255,255,255);
-	if (old_f == -1) {
-		old_f = gdImageColorAllocate(im,255,255,255);
-		if (old_f == -1) {
-			old_f = gdImageColorClosest(im,255,255,255);
-		}
-	}
-	/* change old foreground for new foreground
-	 */
-	changeColor(im,old_f,new_f,0);
+    int i;
+    int last = list->num - 1;
+
+    for (i = last; i >= 0; i--) {
+        if (list->min_x[i] == box.min_x && list->min_y[i] == box.min_y &&
+            list->max_x[i] == box.max_x && list->max_y[i] == box.max_y &&
+            list->flags[i] == flags) {
+            list->min_x[i] = list->min_x[last];
+            list->min_y[i] = list->min_y[last];
+            list->max_x[i] = list->max_x[last];
+            list->max_y[i] = list->max_y[last];
+            list->flags[i] = list->flags[last];
+            list->min_x[last] = 0;
+            list->min_y[last] = 0;
+            list->max_x[last] = 0;
+            list->max_y[last] = 0;
+            list->flags[last] = 0;
+            list->num--;
+            return TRUE;
+        }
+    }
+    return FALSE;
 }
 
 
-
-
 /*
 ------------------------------------------------------------------------------
-Rotate and scale a game_object gif with optional resampling, the resampling
-only works on a black background.
+Get the clash of a text box and a leader box with the boxes in a list which 
+have all the required flags. The text overlap counts in full, the leader 
+overlap is weighted and truncated per box, a weighting of 0 means there is no 
+leader
 
-Note if recolouring - recolour before transforming the image
+Return:
+ total overlap area
 
 */
-gdImagePtr spinImage(gdImagePtr im_in, double angle, double scale, int resample)
+static int BoxList_overlapScalar(BoxList *list, Box text, Box leader, 
+                                 double weighting, int required)
 {
-    /* Input and output images 
-     */
-    gdImagePtr im_out;
+    Box box;
+    int total = 0;
+    int i;
 
-    /* image sizes 
-     */
-    int in_x,
-        in_y,
-        out_l;
+    for (i = 0; i < list->num; i++) {
+        if ((list->flags[i] & required) != required) {
+            continue;
+        }
+        box = BoxList_get(list, i);
+        total += Box_overlap(box, text);
+        if (weighting != 0.0) {
+            total += (int) (Box_overlap(box, leader) * weighting);
+        }
+    }
+    return total;
+}
 
-    /* image centre co-ords 
-     */
-    int in_xcen,
-        in_ycen;
-    int out_xcen,
-        out_ycen;
+#ifdef BOX_SIMD
 
-    /* Color indexes 
-     */
-    int incol,
-        outcol = -1;
-    int out_trans;
+/*
+------------------------------------------------------------------------------
+SSE2 has no 32 bit min, max or multiply so build them, the multiply only
+needs to handle non negative values
 
-    /* color components of input pixel 
-     */
-    int blue;
-    int red;
-    int green;
+*/
+__attribute__((target("sse2")))
+static __m128i sse2_min(__m128i a, __m128i b)
+{
+    __m128i gt = _mm_cmpgt_epi32(a, b);
 
-    /* variables for rotation stuff 
-     */
-    int xp,
-        yp,
-        xsup,
-        ysup;
-    int sample_count;
-    double xout,
-           yout;
-    double r,
-           angle_p,
-           angle_q;
-    
-    int xq,
-        yq;
+    return _mm_or_si128(_mm_and_si128(gt, b), _mm_andnot_si128(gt, a));
+}
 
-    in_x = im_in->sx;
-    in_y = im_in->sy;
-    in_xcen = in_x / 2;
-    in_ycen = in_y / 2;
+__attribute__((target("sse2")))
+static __m128i sse2_max(__m128i a, __m128i b)
+{
+    __m128i gt = _mm_cmpgt_epi32(a, b);
 
-    /* calculate size of output images 
-     */
-    out_l = (int) (0.9999 + scale * sqrt((double) (in_x * in_x + in_y * in_y)));
-    out_xcen = out_l / 2;
-    out_ycen = out_l / 2;
+    return _mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b));
+}
 
-    /* Create output image 
-     */
-    im_out = gdImageCreate(out_l, out_l);
+__attribute__((target("sse2")))
+static __m128i sse2_mul(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
 
-    /* First color allocated is background. 
-     */
-    if (color) {
-        /* black
-         */
-        out_trans = gdImageColorAllocate(im_out, 0, 0, 0);
-    }else{
-        /* white
-         */
-        out_trans = gdImageColorAllocate(im_out, 255, 255, 255);
-    }
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, 0x08),
+                              _mm_shuffle_epi32(odd, 0x08));
+}
 
-    /* Set transparent color. 
-     */
-    gdImageColorTransparent(im_out, out_trans);
-	
 
-    /* produce rotated copy of input image in output image with optional 
-     * resampling
-     */
-    for (xp = 0; xp < out_l; xp++) {
-        for (yp = 0; yp < out_l; yp++) {
-            sample_count = 0;
-            red = 0;
-            green = 0;
-            blue = 0;
-
-            if (resample ) {
-                /* sample upto 25 probes around the equivalent point in the 
-                 * original image taking the new images rotation and scale 
-				 * into account
-                 *               (xp+0.4, yp+0.4)
-                 *           +---+
-                 *           | * |        * = (xp,yp)
-                 *           +---+
-                 * (xp-0.4, yp-0.4)
-                 * 
-                 * if the rotation angle is 0 and the scaling factor 1 then 
-                 * these points should all fall on a single input pixel. For 
-                 * an output pixel at (x,y) these points should be in the area:
-                 *
-                 * These co-ordinates are scaled and rotated to give points in 
-                 * the input image. The RGB values of the input pixels nearest 
-                 * to these points are then averaged to give the color of the 
-                 * output pixel.
-                 * 
-                 * pixel co-ordinates are integers, so you can consider the 
-                 * actual co-ordinates to lie at the centre of a square 1 unit 
-                 * across, inside which float co-ords round onto the pixel.
-                 */
-                for (xsup = 0; xsup < 5; xsup++) {
-                    for (ysup = 0; ysup < 5; ysup++) {
-
-                        xout = (double) (xp + (xsup * (double) 0.2) - 0.4);
-                        yout = (double) (yp + (ysup * (double) 0.2) - 0.4);
-                        r = sqrt((double) ((xout - out_xcen) * (xout - out_xcen)
-                                           + (yout - out_ycen) * 
-                                           (yout - out_ycen))) / scale;
-						if ( r > MIN_RADIUS ) { 
-							angle_p = atan2(yout - (double)out_ycen, 
-											xout - (double)out_xcen);
-						}else{
-							angle_p = 0.0;
-						}
-                        angle_q = angle_p - angle;
-                        xq = Rint(r * cos(angle_q) + (double)in_xcen);
-                        yq = Rint(r * sin(angle_q) + (double)in_ycen);
-
-                        if (gdImageBoundsSafe(im_in, xq, yq)) {
-                            sample_count++;
-                            incol = gdImageGetPixel(im_in, xq, yq);
-                            red += gdImageRed(im_in, incol);
-                            green += gdImageGreen(im_in, incol);
-                            blue += gdImageBlue(im_in, incol);
-                        }
-                    }
-                }
+/*
+------------------------------------------------------------------------------
+Get the areas of overlap between a box and 4 list boxes
 
-                /* if samples taken in original image take the mean color and 
-                 * get the closest match in the new image
-                 */
-                if (sample_count > 0) {
-                    red /= sample_count;
-                    green /= sample_count;
-                    blue /= sample_count;
-                }else{
-                    outcol = out_trans;
-                }
+*/
+__attribute__((target("sse2")))
+static __m128i sse2_overlap(BoxList *list, int i, Box box)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i w,
+            h;
+
+    w = _mm_sub_epi32(sse2_min(_mm_load_si128((__m128i *) (list->max_x + i)),
+                               _mm_set1_epi32(box.max_x)),
+                      sse2_max(_mm_load_si128((__m128i *) (list->min_x + i)),
+                               _mm_set1_epi32(box.min_x)));
+    h = _mm_sub_epi32(sse2_min(_mm_load_si128((__m128i *) (list->max_y + i)),
+                               _mm_set1_epi32(box.max_y)),
+                      sse2_max(_mm_load_si128((__m128i *) (list->min_y + i)),
+                               _mm_set1_epi32(box.min_y)));
+    return sse2_mul(sse2_max(w, zero), sse2_max(h, zero));
+}
 
-            }else{
-                xout = (double) xp;
-                yout = (double) yp;
-                r = sqrt((double) ((xout - out_xcen) * (xout - out_xcen)
-                                   + (yout - out_ycen) * 
-                                   (yout - out_ycen))) / scale;
-				if ( r > MIN_RADIUS ) {
-					angle_p = atan2(yout - (double)out_ycen, 
-									xout - (double)out_xcen);
-				}else{
-					angle_p = 0.0;
-				}
-                angle_q = angle_p - angle;
-                xq = Rint(r * cos(angle_q) + (double)in_xcen);
-                yq = Rint(r * sin(angle_q) + (double)in_ycen);
-                if (gdImageBoundsSafe(im_in, xq, yq)) {
-                    incol = gdImageGetPixel(im_in, xq, yq);
-                    red = gdImageRed(im_in, incol);
-                    green = gdImageGreen(im_in, incol);
-                    blue = gdImageBlue(im_in, incol);                   
-                }else{
-                    outcol = out_trans;
-                }
-            }
 
-            /* allocate best color in output image
-             */
-            if (outcol == -1) {
-                outcol = gdImageColorExact(im_out, red, green, blue);
-                if (outcol == -1) {
-                    outcol = gdImageColorAllocate(im_out, red, green, blue);
-                    if (outcol == -1) {
-                        outcol = gdImageColorClosest(im_out, red, green, 
-                                                     blue);
-                    }
-                }
-            }
-            gdImageSetPixel(im_out, xp, yp, outcol);
-            outcol = -1;
+/*
+------------------------------------------------------------------------------
+SSE2 version of BoxList_overlapScalar, 4 boxes at a time. The leader areas 
+are weighted in double precision and truncated exactly as the scalar code
+
+*/
+__attribute__((target("sse2")))
+static int BoxList_overlapSse2(BoxList *list, Box text, Box leader, 
+                               double weighting, int required)
+{
+    __m128d weight = _mm_set1_pd(weighting);
+    __m128i need = _mm_set1_epi32(required);
+    __m128i sum = _mm_setzero_si128();
+    __m128i keep;
+    __m128i area;
+    __m128i lo,
+            hi;
+    int i;
+
+    for (i = 0; i < list->num; i += 4) {
+        keep = _mm_cmpeq_epi32(_mm_and_si128(_mm_load_si128((__m128i *) 
+                                                            (list->flags + i)),
+                                             need), need);
+        sum = _mm_add_epi32(sum, _mm_and_si128(sse2_overlap(list, i, text), keep));
+        if (weighting != 0.0) {
+            area = _mm_and_si128(sse2_overlap(list, i, leader), keep);
+            lo = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(area), weight));
+            hi = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(
+                                      _mm_shuffle_epi32(area, 0x0e)), weight));
+            sum = _mm_add_epi32(sum, _mm_unpacklo_epi64(lo, hi));
         }
     }
-    return im_out;
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+    return _mm_cvtsi128_si32(sum);
 }
 
 
 /*
 ------------------------------------------------------------------------------
-Get the area of overlap between game object and area defined by position and 
-height and width
-
-Return:
- overlap area
+Get the areas of overlap between a box and 8 list boxes
 
 */
-int overlap(GameObject game_object, int x, int y, int w, int h)
+__attribute__((target("avx2")))
+static __m256i avx2_overlap(BoxList *list, int i, Box box)
 {
-    int min_x,
-        min_y,
-        max_x,
-        max_y;
-
-    min_x = MAX(game_object.cen_x - game_object.radius, x);
-    min_y = MAX(game_object.cen_y - game_object.radius, y);
-    max_x = MIN(game_object.cen_x + game_object.radius, x + w);
-    max_y = MIN(game_object.cen_y + game_object.radius, y + h);
-
-    if ((min_x >= max_x) || (min_y >= max_y)) {
-        return 0;
-    } else {
-        return (max_x - min_x) * (max_y - min_y);
-    }
+    __m256i zero = _mm256_setzero_si256();
+    __m256i w,
+            h;
+
+    w = _mm256_sub_epi32(_mm256_min_epi32(_mm256_load_si256((__m256i *) (list->max_x + i)),
+                                          _mm256_set1_epi32(box.max_x)),
+                         _mm256_max_epi32(_mm256_load_si256((__m256i *) (list->min_x + i)),
+                                          _mm256_set1_epi32(box.min_x)));
+    h = _mm256_sub_epi32(_mm256_min_epi32(_mm256_load_si256((__m256i *) (list->max_y + i)),
+                                          _mm256_set1_epi32(box.max_y)),
+                         _mm256_max_epi32(_mm256_load_si256((__m256i *) (list->min_y + i)),
+                                          _mm256_set1_epi32(box.min_y)));
+    return _mm256_mullo_epi32(_mm256_max_epi32(w, zero), _mm256_max_epi32(h, zero));
 }
 
 
 /*
 ------------------------------------------------------------------------------
-Draw a circle in specified color around game_object
+AVX2 version of BoxList_overlapScalar, 8 boxes at a time
 
 */
-void circleGameObject(gdImagePtr image, GameObject game_object, int color)
+__attribute__((target("avx2")))
+static int BoxList_overlapAvx2(BoxList *list, Box text, Box leader, 
+                               double weighting, int required)
 {
-    gdImageArc(image, game_object.cen_x, game_object.cen_y, 
-               2 * game_object.radius, 2 * game_object.radius,
-               0, 360, color);
+    __m256d weight = _mm256_set1_pd(weighting);
+    __m256i need = _mm256_set1_epi32(required);
+    __m256i sum = _mm256_setzero_si256();
+    __m256i keep;
+    __m256i area;
+    __m128i lo,
+            hi;
+    __m128i total;
+    int i;
+
+    for (i = 0; i < list->num; i += BOX_LIST_BLOCK) {
+        keep = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_load_si256((__m256i *) 
+                                                                     (list->flags + i)),
+                                                   need), need);
+        sum = _mm256_add_epi32(sum, _mm256_and_si256(avx2_overlap(list, i, text), keep));
+        if (weighting != 0.0) {
+            area = _mm256_and_si256(avx2_overlap(list, i, leader), keep);
+            lo = _mm256_cvttpd_epi32(_mm256_mul_pd(
+                     _mm256_cvtepi32_pd(_mm256_castsi256_si128(area)), weight));
+            hi = _mm256_cvttpd_epi32(_mm256_mul_pd(
+                     _mm256_cvtepi32_pd(_mm256_extracti128_si256(area, 1)), weight));
+            sum = _mm256_add_epi32(sum, _mm256_inserti128_si256(
+                                            _mm256_castsi128_si256(lo), hi, 1));
+        }
+    }
+    total = _mm_add_epi32(_mm256_castsi256_si128(sum), 
+                          _mm256_extracti128_si256(sum, 1));
+    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, 0x4e));
+    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, 0xb1));
+    return _mm_cvtsi128_si32(total);
 }
 
+#endif
 
-/*
+/* clash kernel chosen for the cpu by BoxMgr_init */
+static int (*BoxList_overlap)(BoxList *list, Box text, Box leader, 
+                              double weighting, int required) = BoxList_overlapScalar;
+
+
+/* Mask_popcount
 ------------------------------------------------------------------------------
-Read command arguments
+Count the set bits in a mask word
 
 */
-void getArgs(int argc, char* argv[])
+static ALWAYS_INLINE int Mask_popcount(uint64_t word)
 {
-    int c=0;
+#ifdef __GNUC__
+    return __builtin_popcountll(word);
+#else
+    word = word - ((word >> 1) & 0x5555555555555555ULL);
+    word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int) ((word * 0x0101010101010101ULL) >> 56);
+#endif
+}
 
-    while (--argc > 0 && (*++argv)[0] == '-') { /* walks args */
-        while ( (c = *++argv[0]) ) {                /* walks arg string */
-            switch (toupper(c)) {
-                case 'A': {
-                    resample = 1;
-                    break;
-                }               
-                case 'B': {
-                    color = 0;
-                    break;
-                }               
-                case 'D': {
-                    debug = 1;
-                    break;
-                }	
-                case 'F': {
-                    gif_filename = strdup((++argv)[0]);
-                    argc--;
-                    break;
-                }
-				case 'G': {
-                    grid = 1;
-                    break;
-                }
-                case 'I': {
-                    image_dir = strdup((++argv)[0]);
-                    argc--;
-                    break;
-                }
-                case 'L': {
-                    legend = 1;
-                    break;
-                }
-				case 'R': {
-                    resource_filename = strdup((++argv)[0]);
-					argc--;
-                    break;
-                }
-                case 'T': {
-                    real_thrust = 1;
-                    break;
-                }
-                case 'V': {
-                    verbose = 1;
-                    break;
-                }
-                case 'W': {
-                    wallpaper = 1;
-                    break;
-                }
-                default: {
-                    fprintf(stderr,"ftmap: illegal option %c\n",c);
-                    argc=0;
-                    break;
-                }
+
+/* Mask_create
+------------------------------------------------------------------------------
+Make a coverage mask of the top left w by h pixels of an image, a pixel is 
+covered if it isn't the transparent color. The mask only holds the smallest
+box around the covered pixels
+
+*/
+Mask *Mask_create(gdImagePtr im, int w, int h)
+{
+    Mask *mask;
+    int min_x = INT_MAX,
+        min_y = INT_MAX,
+        max_x = 0,
+        max_y = 0;
+    int x,
+        y;
+
+    mask = (Mask *) malloc(sizeof (Mask));
+    if (mask == NULL) {
+        fprintf(stderr,"**** Error out of memory for image masks\n**** Aborting\n");
+        exit(1);
+    }
+    w = MIN(w, gdImageSX(im));
+    h = MIN(h, gdImageSY(im));
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            if (gdImageGetPixel(im, x, y) != gdImageGetTransparent(im)) {
+                min_x = MIN(min_x, x);
+                min_y = MIN(min_y, y);
+                max_x = MAX(max_x, x + 1);
+                max_y = MAX(max_y, y + 1);
             }
-            break;
         }
     }
-    if (argc) {
-        fprintf(stderr,"usage: ftmap -a -b -d "
-                "-f filename.gif -g -i image_dir -l -r resource.ini -t -v -w\n");
+    if (min_x == INT_MAX) {
+        min_x = min_y = 0;
+    }
+    mask->x = min_x;
+    mask->y = min_y;
+    mask->w = max_x - min_x;
+    mask->h = max_y - min_y;
+    mask->words = (mask->w + 63) / 64;
+    mask->bits = (uint64_t *) calloc(mask->words * mask->h + 1, sizeof (uint64_t));
+    if (mask->bits == NULL) {
+        fprintf(stderr,"**** Error out of memory for image masks\n**** Aborting\n");
         exit(1);
     }
+    for (y = 0; y < mask->h; y++) {
+        for (x = 0; x < mask->w; x++) {
+            if (gdImageGetPixel(im, mask->x + x, mask->y + y) != 
+                gdImageGetTransparent(im)) {
+                mask->bits[y * mask->words + x / 64] |= (uint64_t) 1 << (x % 64);
+            }
+        }
+    }
+    return mask;
 }
 
+/* Sprite_trim
+------------------------------------------------------------------------------
+Make a sprite from a rotated image, the image is square and centred on the 
+game object, only the 2 x radius side drawn before is kept. The sprite image
+is cut down to the opaque pixels and the image given is destroyed
 
+*/
+void Sprite_trim(Sprite *sprite, gdImagePtr image)
+{
+    gdImagePtr trimmed;
+    Mask *mask;
+    int side = 2 * (gdImageSX(image) / 2);
+    int i;
+    int x;
 
-/*
+    mask = Mask_create(image, side, side);
+    trimmed = gdImageCreate(MAX(mask->w, 1), MAX(mask->h, 1));
+    for (i = 0; i < gdImageColorsTotal(image); i++) {
+        trimmed->red[i] = image->red[i];
+        trimmed->green[i] = image->green[i];
+        trimmed->blue[i] = image->blue[i];
+        trimmed->open[i] = image->open[i];
+    }
+    trimmed->colorsTotal = image->colorsTotal;
+    trimmed->transparent = image->transparent;
+    if (mask->w == 0 || mask->h == 0) {
+        trimmed->pixels[0][0] = MAX(image->transparent, 0);
+    }
+    for (x = 0; x < mask->w; x++) {
+        memcpy(trimmed->pixels[x], image->pixels[mask->x + x] + mask->y, mask->h);
+    }
+    sprite->off_x = mask->x - side / 2;
+    sprite->off_y = mask->y - side / 2;
+    mask->x = 0;
+    mask->y = 0;
+    sprite->image = trimmed;
+    sprite->mask = mask;
+    sprite->foreground = NOT_DEFINED;
+    gdImageDestroy(image);
+}
+
+
+/* Sprite_draw
 ------------------------------------------------------------------------------
-Draw map reference system, this is a pair of cartesan axes always along the
-bottom x & y axis of the image
+Draw a sprite centred at x,y
 
 */
-void drawMapAxes(gdImagePtr im, int axes_text_color, int axes_color,
-                 double pix_per_unit, int min_x, int min_y)
+void Sprite_draw(gdImagePtr im, Sprite *sprite, int x, int y)
 {
-    int a=0;
-	int len=0;
-    int max_len = 0;
-    char text[10];
+    gdImageCopy(im, sprite->image, x + sprite->off_x, y + sprite->off_y, 0, 0,
+                sprite->mask->w, sprite->mask->h);
+}
 
-	gdImageSetStyle(im,lgrid,lgrid_size);
 
-    /* Y-Axis Line
-     */
-    gdImageLine(im, 0, 0, 0, im->sy - 1,axes_color);
 
-    /* X-Axis Line 
-     */
-    gdImageLine(im,0,im->sy-1,im->sx-1,im->sy-1,axes_color);
+/* Mask_overlap
+------------------------------------------------------------------------------
+Get the number of covered mask pixels inside a box, with the mask top left 
+at x,y. Each mask row is ANDed with the box columns a word at a time
 
-    /* Mark up X-Axis 
-     */
-    for (a = Rint(min_x);
-         Rint((double)(a - min_x)* pix_per_unit) < im->sx-1; a++) {
-        int x1;
+Return:
+ overlap area
 
-        x1 = Rint((double)(a - min_x) * pix_per_unit);
-        switch (abs (a % 10)) {
+*/
+static ALWAYS_INLINE int Mask_overlap(Mask *mask, int x, int y, Box box)
+{
+    uint64_t *row;
+    uint64_t first_bits,
+             last_bits;
+    int x0 = MAX(box.min_x - x, 0);
+    int x1 = MIN(box.max_x - x, mask->w);
+    int y0 = MAX(box.min_y - y, 0);
+    int y1 = MIN(box.max_y - y, mask->h);
+    int first_word,
+        last_word;
+    int total = 0;
+    int i;
 
-            case 0:
-               len = sprintf(text, "%d", a);
-               if (x1 == 0) {
-                  ;
-               }else{ 
-                   gdImageLine(im,x1,im->sy-1,x1,im->sy-11,axes_color);
-                   gdImageString(im,gdFontSmall,
-                                 x1 - (len / 2) * ((gdFont *) gdFontSmall)->w,
-                                 im->sy - 11 - ((gdFont *) gdFontSmall)->h,
-                                 text, axes_text_color);
-               }
-			   /* draw optional grid 
-				*/
-               if (grid) {
-				  gdImageLine(im,x1,
-							  im->sy - 11 - ((gdFont *) gdFontSmall)->h,
-							  x1,0,gdStyled); 
-				  BoxMgr_add
-					  (Box_dilate
-					   (Box_boxInt
-						(x1,im->sy - 11 - ((gdFont *) gdFontSmall)->h,x1,0)
-						,LINE_DILATION));
-			  } 
-			   break;
-            
-            case 5:
-            gdImageLine(im,x1,im->sy-1,x1,im->sy-6,axes_color);
-            break;
-            
-            default:
-            gdImageLine(im,x1,im->sy-1,x1,im->sy-3,axes_color);
-            break;
+    if (x0 >= x1 || y0 >= y1) {
+        return 0;
+    }
+    first_word = x0 / 64;
+    last_word = (x1 - 1) / 64;
+    first_bits = ~(uint64_t) 0 << (x0 % 64);
+    last_bits = ~(uint64_t) 0 >> (63 - (x1 - 1) % 64);
+    if (first_word == last_word) {
+        first_bits &= last_bits;
+    }
+    for (row = mask->bits + y0 * mask->words; y0 < y1; y0++, row += mask->words) {
+        total += Mask_popcount(row[first_word] & first_bits);
+        if (first_word != last_word) {
+            for (i = first_word + 1; i < last_word; i++) {
+                total += Mask_popcount(row[i]);
+            }
+            total += Mask_popcount(row[last_word] & last_bits);
         }
     }
-    /* Add clash box for X axis for height of text on axis (bottom) and for 
-	 * edge of map (top)
-     *
-     *
-     *           +----------------------+
-     *      top  |                      | 
-     *           +-y-+--------------+---+ 
-     *           | | |              |   |
-     *     left  | | |              |   | right
-     *           | | |              |   |
-     *           | | |              |   |
-	 *           +-|-+--------------+---+ 
-     *           | -----------------x   | bottom
-     *           +----------------------+
-     *
-	 *
-	 * top then bottom 
-	 */
-    BoxMgr_add(Box_boxInt(-EDGE_DILATION,0,im->sx+EDGE_DILATION,
-						  -EDGE_DILATION));
-    BoxMgr_add(Box_boxInt(-EDGE_DILATION,im->sy+EDGE_DILATION,
-						  im->sx+EDGE_DILATION,
-                          im->sy - 11 - ((gdFont *)gdFontSmall)->h));
+    return total;
+}
 
-    /* Mark up Y-Axis get the widest annotation width 
-     */
-    for (a = Rint(min_y); 
-         Rint((double)(a - min_y) * pix_per_unit) < im->sy-1; a++) {
-        int y1;
 
-        y1 = Rint((double)im->sy - (double)(a - min_y)* pix_per_unit);
-        switch (abs (a % 10)) {
+/*
+------------------------------------------------------------------------------
+Append mask to a mask list growing it as required
 
-            case 0:
-            len = sprintf(text, "%d", a);
+*/
+static void MaskList_add(MaskList *list, Mask *mask, int x, int y, int flags)
+{
+    if (list->num == list->max) {
+        list->max = list->max ? list->max * 2 : BOX_LIST_BLOCK;
+        list->ref = (MaskRef *) realloc(list->ref, list->max * sizeof (MaskRef));
+        if (list->ref == NULL) {
+            fprintf(stderr,"**** Error out of memory for clash boxes\n**** Aborting\n");
+            exit(1);
+        }
+    }
+    list->ref[list->num].mask = mask;
+    list->ref[list->num].x = x;
+    list->ref[list->num].y = y;
+    list->ref[list->num].flags = flags;
+    list->num++;
+}
 
-			/* save widest text width 
-			 */
-			if (len > max_len) {
-				max_len = len;
-			}
 
-            /* special don't annotate where the axes cross
-             */
-            if ( y1 == im->sy  ) {
-                ;
-            }else{
-            
-                gdImageLine(im,0,y1,10,y1,axes_color);
-                gdImageString(im,gdFontSmall,10+((gdFont *) gdFontSmall)->w,
-                              y1 - ((gdFont *) gdFontSmall)->h / 2,
-                              text,axes_text_color);
-            }
+/*
+------------------------------------------------------------------------------
+Get the clash of a text box and a weighted leader box with the masks in a 
+list which have all the required flags, as BoxList_overlap
 
-			/* draw optional grid 
-			 */
-			if (grid) {
-			   gdImageLine(im,
-						   10 + (((gdFont*)gdFontSmall)->w * (len+1)) 
-						   ,y1,im->sx,y1,gdStyled);
-			   BoxMgr_add
-				   (Box_dilate
-					(Box_boxInt
-					 (10 + (((gdFont*)gdFontSmall)->w * (len+1)) ,y1,im->sx,y1)
-					 ,LINE_DILATION));
-		   }
-            break;
-            
-            case 5: 
-            gdImageLine(im,0,y1,5,y1,axes_color);
-            break;
-            
-            default:
-            gdImageLine(im,0,y1,2,y1,axes_color);
-            break;
+Return:
+ total overlap area
+
+*/
+static ALWAYS_INLINE int MaskList_overlapAll(MaskList *list, Box text, Box leader, 
+                                             double weighting, int required)
+{
+    MaskRef *ref;
+    int total = 0;
+    int i;
+
+    for (i = 0; i < list->num; i++) {
+        ref = &list->ref[i];
+        if ((ref->flags & required) != required) {
+            continue;
+        }
+        total += Mask_overlap(ref->mask, ref->x, ref->y, text);
+        if (weighting != 0.0) {
+            total += (int) (Mask_overlap(ref->mask, ref->x, ref->y, leader) * 
+                            weighting);
         }
     }
-	/* Add clash box for Y axis for axis widest text on axis (left) and for 
-	 * edge of map (right) (see diagram above)
-	 *
-	 * left then right
-	 */
-    BoxMgr_add(Box_boxInt(-EDGE_DILATION,0,
-						  10 + (((gdFont *)gdFontSmall)->w * ++max_len),
-                          im->sy - 1));    
-    BoxMgr_add(Box_boxInt(im->sx,0,im->sx+EDGE_DILATION,im->sy - 1)); 
+    return total;
 }
 
+static int MaskList_overlapScalar(MaskList *list, Box text, Box leader, 
+                                  double weighting, int required)
+{
+    return MaskList_overlapAll(list, text, leader, weighting, required);
+}
 
+#ifdef BOX_SIMD
 
-/*
-------------------------------------------------------------------------------
-Draw vector trail for game_objects course in Full or real thrust style
+/* same again using the popcnt instruction
+ */
+__attribute__((target("popcnt")))
+static int MaskList_overlapPopcnt(MaskList *list, Box text, Box leader, 
+                                  double weighting, int required)
+{
+    return MaskList_overlapAll(list, text, leader, weighting, required);
+}
 
-In Full Thrust style the course is drawn along the game objects track using the
-delta heading value.
+#endif
 
-In Real thrust style the course is drawn along the current heading at
-the current velocity showing where the game object will be if its course
-is not modified
+/* mask kernel chosen for the cpu by BoxMgr_init */
+static int (*MaskList_overlap)(MaskList *list, Box text, Box leader, 
+                               double weighting, int required) = MaskList_overlapScalar;
+
+
+/* Segment_create
+------------------------------------------------------------------------------
+Make a thick line segment obstacle from x1,y1 to x2,y2. The segment is a 
+rectangle thickness either side of the line and past each end, so an 
+orthogonal segment covers the same pixels as the line's box dilated by the 
+thickness
 
 */
-void plotCourse(gdImagePtr im, GameObject game_object, int color)
+Segment Segment_create(int x1, int y1, int x2, int y2, int thickness)
 {
-    double m2;
-    double m1;
-    double rad_heading;
-
-    double mid_x,
-           mid_y,
-           start_x,
-           start_y,
-           end_x,
-           end_y;
-    int h1,
-        h2;
-    int pix_mid_x,
-        pix_mid_y,
-        pix_start_x,
-        pix_start_y,
-        pix_end_x,
-        pix_end_y;
+    Segment seg;
+    double dx = x2 - x1;
+    double dy = y2 - y1;
+    double length = sqrt(dx * dx + dy * dy);
+
+    memset(&seg, 0, sizeof (Segment));
+    seg.line.start.x = x1;
+    seg.line.start.y = y1;
+    seg.line.end.x = x2;
+    seg.line.end.y = y2;
+    seg.thickness = thickness;
+    seg.orthogonal = Line_isOrthogonal(x1, y1, x2, y2);
+    seg.bounds = Box_dilate(Box_boxInt(x1, y1, x2, y2), seg.orthogonal ? 
+                            thickness : (int) ceil(thickness * sqrt(2.0)));
+    seg.area = 2.0 * thickness * (length + 2.0 * thickness);
+
+    if (length > 0.0) {
+        dx = dx / length * thickness;
+        dy = dy / length * thickness;
+    }else{
+        dx = thickness;
+        dy = 0.0;
+    }
+    seg.corner_x[0] = x1 - dx + dy;
+    seg.corner_y[0] = y1 - dy - dx;
+    seg.corner_x[1] = x2 + dx + dy;
+    seg.corner_y[1] = y2 + dy - dx;
+    seg.corner_x[2] = x2 + dx - dy;
+    seg.corner_y[2] = y2 + dy + dx;
+    seg.corner_x[3] = x1 - dx - dy;
+    seg.corner_y[3] = y1 - dy + dx;
+    return seg;
+}
 
-    int mid_turn;
 
-    /* Set tracking linestyle 
-     */
-    gdImageSetStyle(im,lcourse,lcourse_size);
+/* Segment_separated
+------------------------------------------------------------------------------
+Check if a rectangle is clear of a segment across one of the segment's axes,
+the axis being the edge from corner a to corner b
 
-    if (real_thrust) {
-        /* Real Thrust course plot
-         */
-        rad_heading = (game_object.heading / 180.0) * M_PI;
-        end_x = game_object.x + (game_object.speed * sin(rad_heading));
-        end_y = game_object.y + (game_object.speed * cos(rad_heading));
-        pix_end_x = (int) Rint((end_x - min_x) * pix_per_unit);
-        pix_end_y = im->sy - 1 - (int) Rint((end_y - min_y) * pix_per_unit);;
+*/
+static ALWAYS_INLINE int Segment_separated(Segment *seg, int a, int b, 
+                                           double min_x, double min_y, 
+                                           double max_x, double max_y)
+{
+    double axis_x = seg->corner_x[b] - seg->corner_x[a];
+    double axis_y = seg->corner_y[b] - seg->corner_y[a];
+    double centre = (min_x + max_x) / 2.0 * axis_x + (min_y + max_y) / 2.0 * axis_y;
+    double half = (max_x - min_x) / 2.0 * fabs(axis_x) + 
+        (max_y - min_y) / 2.0 * fabs(axis_y);
+    double lo = seg->corner_x[a] * axis_x + seg->corner_y[a] * axis_y;
+    double hi = seg->corner_x[b] * axis_x + seg->corner_y[b] * axis_y;
+
+    return centre + half <= lo || centre - half >= hi;
+}
 
-        /* Draw line. Add course extent to the text box manager if orthogonal, if not don't bother as 
-         * angled lines eat up too much map white space
-         */
-        gdImageLine(im, game_object.cen_x, game_object.cen_y, pix_end_x, pix_end_y,
-                    gdStyled);
-        if (Line_isOrthogonal(game_object.cen_x, game_object.cen_y, pix_end_x, pix_end_y)) {
 
-            /* as course is orthogonal dilate the box otherwise it has a zero
-             * dimension 
-             */
-            BoxMgr_add(Box_dilate(Box_boxInt(game_object.cen_x, game_object.cen_y, 
-                                             pix_end_x, pix_end_y),LINE_DILATION));
+/* Polygon_clip
+------------------------------------------------------------------------------
+Clip a convex polygon to one side of a vertical (on_x) or horizontal line, 
+keeping the part above or below the limit. Crossing points land exactly on
+the limit so axis aligned shapes clip without rounding
+
+Return:
+ number of vertices in the clipped polygon
+
+*/
+static ALWAYS_INLINE int Polygon_clip(double *x, double *y, int n, int on_x, 
+                                      double limit, int keep_below, 
+                                      double *out_x, double *out_y)
+{
+    int num = 0;
+    int i,
+        prev;
+    int in,
+        prev_in;
+    double v,
+           prev_v;
+    double t;
+
+    for (i = 0, prev = n - 1; i < n; prev = i++) {
+        v = on_x ? x[i] : y[i];
+        prev_v = on_x ? x[prev] : y[prev];
+        in = keep_below ? (v <= limit) : (v >= limit);
+        prev_in = keep_below ? (prev_v <= limit) : (prev_v >= limit);
+        if (in != prev_in) {
+            t = (limit - prev_v) / (v - prev_v);
+            if (on_x) {
+                out_x[num] = limit;
+                out_y[num] = y[prev] + t * (y[i] - y[prev]);
+            }else{
+                out_x[num] = x[prev] + t * (x[i] - x[prev]);
+                out_y[num] = limit;
+            }
+            num++;
+        }
+        if (in) {
+            out_x[num] = x[i];
+            out_y[num] = y[i];
+            num++;
         }
     }
-    else {
-        /* Full Thrust course plot
-         */
-        mid_turn = game_object.delta_heading - 
-            (int) ((double) game_object.delta_heading / 2.0);
-        h2 = game_object.heading % 12;
-        h1 = (game_object.heading - mid_turn) % 12;
-        m2 = game_object.speed / 2.0;
-        m1 = m2; 
- 
-        mid_x = game_object.x - (m2 * sin(M_PI * (double) h2 / 6.0));
-        mid_y = game_object.y - (m2 * cos(M_PI * (double) h2 / 6.0));
-        start_x = mid_x - (m1 * sin(M_PI * (double) h1 / 6.0));
-        start_y = mid_y - (m1 * cos(M_PI * (double) h1 / 6.0));
+    return num;
+}
 
-        pix_mid_x = (int) Rint((mid_x - min_x) * pix_per_unit);
-        pix_mid_y = im->sy - 1 - (int) Rint((mid_y - min_y) * pix_per_unit);
-        pix_start_x = (int) Rint((start_x - min_x) * pix_per_unit);
-        pix_start_y = im->sy - 1 - (int) Rint((start_y - min_y) * pix_per_unit);
 
-        /* Draw line. Add course extent to the text box 
-         * manager if orthogonal, if not don't bother as angled lines eat up too 
-         * much map white space
-         */
-        
-        gdImageLine(im, game_object.cen_x, game_object.cen_y, pix_mid_x, pix_mid_y,
-                    gdStyled);
-        if (Line_isOrthogonal(game_object.cen_x,game_object.cen_y,pix_mid_x,
-                              pix_mid_y)) {
+/* Segment_overlap
+------------------------------------------------------------------------------
+Get the exact area of overlap between a segment and a rectangle, the segment 
+rectangle is clipped to each side in turn and the area of what is left found
+with the shoelace formula
 
-            /* as course is orthogonal dilate the box otherwise it has a zero
-             * dimension 
-             */
-            BoxMgr_add(Box_dilate(Box_boxInt(game_object.cen_x,game_object.cen_y,
-                                             pix_mid_x,pix_mid_y),LINE_DILATION));
+Return:
+ overlap area
+
+*/
+static double Segment_overlap(Segment *seg, double min_x, double min_y, 
+                              double max_x, double max_y)
+{
+    double buffer[4][MAX_POLYGON];
+    double *x = seg->corner_x,
+           *y = seg->corner_y;
+    double area = 0.0;
+    int n;
+    int i,
+        prev;
+
+    if (min_x >= max_x || min_y >= max_y ||
+        seg->bounds.max_x <= min_x || seg->bounds.min_x >= max_x ||
+        seg->bounds.max_y <= min_y || seg->bounds.min_y >= max_y) {
+        return 0.0;
+    }
+    if (seg->orthogonal) {
+        return (MIN(max_x, seg->bounds.max_x) - MAX(min_x, seg->bounds.min_x)) *
+            (MIN(max_y, seg->bounds.max_y) - MAX(min_y, seg->bounds.min_y));
+    }
+    if (min_x <= seg->bounds.min_x && max_x >= seg->bounds.max_x && 
+        min_y <= seg->bounds.min_y && max_y >= seg->bounds.max_y) {
+        return seg->area;
+    }
+    if (Segment_separated(seg, 0, 1, min_x, min_y, max_x, max_y) ||
+        Segment_separated(seg, 0, 3, min_x, min_y, max_x, max_y)) {
+        return 0.0;
+    }
+    /* only clip to the sides the segment crosses, each clip writing to the 
+     * buffer not being read
+     */
+    n = 4;
+    if (seg->bounds.min_x < min_x) {
+        n = Polygon_clip(x, y, n, TRUE, min_x, FALSE, buffer[0], buffer[1]);
+        x = buffer[0];
+        y = buffer[1];
+    }
+    if (seg->bounds.max_x > max_x) {
+        n = Polygon_clip(x, y, n, TRUE, max_x, TRUE, buffer[2], buffer[3]);
+        x = buffer[2];
+        y = buffer[3];
+    }
+    if (seg->bounds.min_y < min_y) {
+        n = Polygon_clip(x, y, n, FALSE, min_y, FALSE, 
+                         x == buffer[0] ? buffer[2] : buffer[0], 
+                         x == buffer[0] ? buffer[3] : buffer[1]);
+        y = (x == buffer[0]) ? buffer[3] : buffer[1];
+        x = (x == buffer[0]) ? buffer[2] : buffer[0];
+    }
+    if (seg->bounds.max_y > max_y) {
+        n = Polygon_clip(x, y, n, FALSE, max_y, TRUE, 
+                         x == buffer[0] ? buffer[2] : buffer[0], 
+                         x == buffer[0] ? buffer[3] : buffer[1]);
+        y = (x == buffer[0]) ? buffer[3] : buffer[1];
+        x = (x == buffer[0]) ? buffer[2] : buffer[0];
+    }
+    for (i = 0, prev = n - 1; i < n; prev = i++) {
+        area += x[prev] * y[i] - x[i] * y[prev];
+    }
+    return fabs(area) / 2.0;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Add and remove segments in a segment list
+
+*/
+static void SegmentList_add(SegmentList *list, Segment seg, int flags)
+{
+    if (list->num == list->max) {
+        list->max = list->max ? list->max * 2 : BOX_LIST_BLOCK;
+        list->segment = (Segment *) realloc(list->segment, 
+                                            list->max * sizeof (Segment));
+        if (list->segment == NULL) {
+            fprintf(stderr,"**** Error out of memory for clash boxes\n**** Aborting\n");
+            exit(1);
         }
+    }
+    list->segment[list->num] = seg;
+    list->segment[list->num++].flags = flags;
+}
 
-        /* add course extent to the text box manager if orthogonal, if not don't 
-         * bother as angled lines eat up too much map white space
-         */
-        gdImageLine(im, pix_mid_x, pix_mid_y, pix_start_x, pix_start_y, gdStyled);
-        if (Line_isOrthogonal(pix_mid_x,pix_mid_y,pix_start_x,pix_start_y)) {
+static void SegmentList_remove(SegmentList *list, Segment seg)
+{
+    int i;
 
-            /* as course is orthogonal dilate the box otherwise it has a zero
-             * dimension 
-             */
-            BoxMgr_add(Box_dilate(Box_boxInt(pix_mid_x,pix_mid_y,pix_start_x,
-                                             pix_start_y),LINE_DILATION));
+    for (i = list->num - 1; i >= 0; i--) {
+        if (memcmp(&list->segment[i].line, &seg.line, sizeof (Line)) == 0 &&
+            list->segment[i].thickness == seg.thickness) {
+            list->segment[i] = list->segment[--list->num];
+            return;
         }
     }
 }
 
 
+/*
+------------------------------------------------------------------------------
+Get the clash of a text box and a weighted leader box with the segments in a 
+list that have all the required flags, range holding both boxes. Each area is
+rounded on its own, the same as the weighted box areas, so the total doesn't
+depend on the order the segments are found in
+
+Return:
+ total overlap area
+
+*/
+static int SegmentList_overlap(SegmentList *list, Box range, Box text, 
+                               Box leader, double weighting, int required)
+{
+    Segment *seg;
+    int total = 0;
+    int i;
+
+    for (i = 0; i < list->num; i++) {
+        seg = &list->segment[i];
+        if ((seg->flags & required) != required ||
+            seg->bounds.max_x <= range.min_x || seg->bounds.min_x >= range.max_x ||
+            seg->bounds.max_y <= range.min_y || seg->bounds.min_y >= range.max_y) {
+            continue;
+        }
+        total += (int) (Segment_overlap(seg, text.min_x, text.min_y, 
+                                        text.max_x, text.max_y) + 0.5);
+        if (weighting != 0.0) {
+            total += (int) (Segment_overlap(seg, leader.min_x, leader.min_y,
+                                            leader.max_x, leader.max_y) * weighting);
+        }
+    }
+    return total;
+}
+
 
 /*
 ------------------------------------------------------------------------------
-Copy an image into the map image
+Get clash grid column or row for a pixel co-ordinate, co-ordinates off the grid
+clamp to the edge cells
 
 */
-void copyBackgroundImage(gdImagePtr map, int x, int y, int w, int h, gdImagePtr back)
+static int BoxGrid_col(BoxGrid *grid, int x)
 {
-    double aspect_ratio;
-    int src_w,
-        src_h,
-        dy,
-        dx;
-    if (debug) {
-        printf("Background transparency %d\n",gdImageGetTransparent(back));
+    if (x <= grid->min_x) {
+        return 0;
     }
-    /* Turn off any transparency or you'll get nasty holes in the background image
-     */
-    gdImageColorTransparent(back,-1);
-    if (back == NULL) {
-        return;
+    return MIN((x - grid->min_x) >> BOX_CELL_SHIFT, grid->cols - 1);
+}
+
+static int BoxGrid_row(BoxGrid *grid, int y)
+{
+    if (y <= grid->min_y) {
+        return 0;
     }
-    /* Wallpaper or stretch the background image
-     */
-    if (wallpaper) {
-        /* Wallpaper tiled
-         */
-        src_w = (int) 1.0 + (w / gdImageSX(back));
-        src_h = (int) 1.0 + (h / gdImageSY(back));
-        for (dy = 0; (dy < src_h); dy++) {
-            for (dx = 0; (dx < src_w); dx++) {
-                gdImageCopy(map, back, dx * back->sx, dy * back->sy, 0, 0, back->sx, back->sy);
-             }
+    return MIN((y - grid->min_y) >> BOX_CELL_SHIFT, grid->rows - 1);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Create clash grid covering the area, boxes outside it go in the edge cells
+
+*/
+static void BoxGrid_init(BoxGrid *grid, int x, int y, int w, int h)
+{
+    grid->min_x = x;
+    grid->min_y = y;
+    grid->cols = (MAX(w, 1) >> BOX_CELL_SHIFT) + 1;
+    grid->rows = (MAX(h, 1) >> BOX_CELL_SHIFT) + 1;
+    grid->cell = (BoxList *) calloc(grid->cols * grid->rows, sizeof (BoxList));
+    grid->masks = (MaskList *) calloc(grid->cols * grid->rows, sizeof (MaskList));
+    grid->segments = (SegmentList *) calloc(grid->cols * grid->rows, 
+                                            sizeof (SegmentList));
+    if (grid->cell == NULL || grid->masks == NULL || grid->segments == NULL) {
+        fprintf(stderr,"**** Error out of memory for clash grid\n**** Aborting\n");
+        exit(1);
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Free clash grid
+
+*/
+static void BoxGrid_free(BoxGrid *grid)
+{
+    int i;
+
+    for (i = 0; i < grid->cols * grid->rows; i++) {
+        free(grid->cell[i].block);
+        free(grid->masks[i].ref);
+        free(grid->segments[i].segment);
+    }
+    free(grid->cell);
+    free(grid->masks);
+    free(grid->segments);
+    grid->cell = NULL;
+    grid->masks = NULL;
+    grid->segments = NULL;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Add box to clash grid
+
+The box goes in every cell it touches. Each copy is flagged with whether the
+cell is the first column and/or first row of the box so a query can count 
+every box exactly once, in the cell where the box and query ranges first meet, 
+without any per box bookkeeping
+
+*/
+static void BoxGrid_add(BoxGrid *grid, Box box)
+{
+    int col,
+        row;
+    int min_col = BoxGrid_col(grid, box.min_x);
+    int max_col = BoxGrid_col(grid, box.max_x);
+    int min_row = BoxGrid_row(grid, box.min_y);
+    int max_row = BoxGrid_row(grid, box.max_y);
+
+    for (row = min_row; row <= max_row; row++) {
+        for (col = min_col; col <= max_col; col++) {
+            BoxList_add(&grid->cell[row * grid->cols + col], box,
+                        (col == min_col ? BOX_FIRST_COL : 0) |
+                        (row == min_row ? BOX_FIRST_ROW : 0));
         }
-    }else{ 
-        /* Stretch to fit 
-         */
-        aspect_ratio = (double) w / (double) h;
-        src_w = Rint(aspect_ratio * (back->sy));
-        src_h = Rint((back->sx) / aspect_ratio);
+    }
+}
 
-        if (src_w > (back->sx)) {
-            src_w = back->sx;
-        } else if (src_h > (back->sy)) {
-            src_h = back->sy;
+
+/*
+------------------------------------------------------------------------------
+Remove box from clash grid, undoing BoxGrid_add
+
+*/
+static void BoxGrid_remove(BoxGrid *grid, Box box)
+{
+    int col,
+        row;
+    int min_col = BoxGrid_col(grid, box.min_x);
+    int max_col = BoxGrid_col(grid, box.max_x);
+    int min_row = BoxGrid_row(grid, box.min_y);
+    int max_row = BoxGrid_row(grid, box.max_y);
+
+    for (row = min_row; row <= max_row; row++) {
+        for (col = min_col; col <= max_col; col++) {
+            BoxList_remove(&grid->cell[row * grid->cols + col], box,
+                           (col == min_col ? BOX_FIRST_COL : 0) |
+                           (row == min_row ? BOX_FIRST_ROW : 0));
         }
-        gdImageCopyResized(map, back, x, y, 0, 0, w, h, src_w, src_h);
     }
 }
 
 
-/*
+/*
+------------------------------------------------------------------------------
+Add mask to clash grid at x,y, flagged by cell as BoxGrid_add
+
+*/
+static void BoxGrid_addMask(BoxGrid *grid, Mask *mask, int x, int y)
+{
+    int col,
+        row;
+    int min_col = BoxGrid_col(grid, x);
+    int max_col = BoxGrid_col(grid, x + mask->w);
+    int min_row = BoxGrid_row(grid, y);
+    int max_row = BoxGrid_row(grid, y + mask->h);
+
+    for (row = min_row; row <= max_row; row++) {
+        for (col = min_col; col <= max_col; col++) {
+            MaskList_add(&grid->masks[row * grid->cols + col], mask, x, y,
+                         (col == min_col ? BOX_FIRST_COL : 0) |
+                         (row == min_row ? BOX_FIRST_ROW : 0));
+        }
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Add or remove a segment in the clash grid, flagged like boxes so a query 
+scores each segment once over the whole query box
+
+*/
+static void BoxGrid_addSegment(BoxGrid *grid, Segment seg, int add)
+{
+    int col,
+        row;
+    int min_col = BoxGrid_col(grid, seg.bounds.min_x);
+    int max_col = BoxGrid_col(grid, seg.bounds.max_x);
+    int min_row = BoxGrid_row(grid, seg.bounds.min_y);
+    int max_row = BoxGrid_row(grid, seg.bounds.max_y);
+
+    for (row = min_row; row <= max_row; row++) {
+        for (col = min_col; col <= max_col; col++) {
+            if (add) {
+                SegmentList_add(&grid->segments[row * grid->cols + col], seg,
+                                (col == min_col ? BOX_FIRST_COL : 0) |
+                                (row == min_row ? BOX_FIRST_ROW : 0));
+            }else{
+                SegmentList_remove(&grid->segments[row * grid->cols + col], seg);
+            }
+        }
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Get the clash of a text box and a weighted leader box with all the boxes in 
+the clash grid. Both are scored in one pass over the cells they cover so each
+grid box is read once. Counting stops as soon as the total reaches the bound
+
+Return:
+ total overlap area, or a value >= bound
+
+*/
+static int BoxGrid_overlap(BoxGrid *grid, Box text, Box leader, 
+                           double weighting, int bound)
+{
+    Box range;
+    int col,
+        row;
+    int total = 0;
+    int min_col,
+        max_col,
+        min_row,
+        max_row;
+
+    range = (weighting != 0.0) ? Box_union(text, leader) : text;
+    min_col = BoxGrid_col(grid, range.min_x);
+    max_col = BoxGrid_col(grid, range.max_x);
+    min_row = BoxGrid_row(grid, range.min_y);
+    max_row = BoxGrid_row(grid, range.max_y);
+
+    for (row = min_row; row <= max_row; row++) {
+        for (col = min_col; col <= max_col; col++) {
+            BoxList *cell = &grid->cell[row * grid->cols + col];
+            MaskList *masks = &grid->masks[row * grid->cols + col];
+            SegmentList *segments = &grid->segments[row * grid->cols + col];
+            int required;
+
+            if (cell->num == 0 && masks->num == 0 && segments->num == 0) {
+                continue;
+            }
+
+            /* away from the first query column or row only boxes which 
+             * start in this cell are new to the query
+             */
+            required = (col != min_col ? BOX_FIRST_COL : 0) |
+                       (row != min_row ? BOX_FIRST_ROW : 0);
+            if (cell->num) {
+                total += BoxList_overlap(cell, text, leader, weighting, required);
+            }
+            if (masks->num) {
+                total += MaskList_overlap(masks, text, leader, weighting, required);
+            }
+            if (segments->num) {
+                total += SegmentList_overlap(segments, range, text, leader,
+                                             weighting, required);
+            }
+            if (total >= bound) {
+                return total;
+            }
+        }
+    }
+    return total;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Create occupancy raster covering the area, tiles are allocated on first use
+
+*/
+static void Raster_init(Raster *raster, int x, int y, int w, int h)
+{
+    raster->min_x = x;
+    raster->min_y = y;
+    raster->w = w;
+    raster->h = h;
+    raster->cols = (w + RASTER_TILE - 1) >> RASTER_TILE_SHIFT;
+    raster->rows = (h + RASTER_TILE - 1) >> RASTER_TILE_SHIFT;
+    raster->tile = (RasterTile *) calloc(raster->cols * raster->rows,
+                                         sizeof (RasterTile));
+    if (raster->tile == NULL) {
+        fprintf(stderr,"**** Error out of memory for occupancy raster\n**** Aborting\n");
+        exit(1);
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Free occupancy raster
+
+*/
+static void Raster_free(Raster *raster)
+{
+    int i;
+
+    for (i = 0; i < raster->cols * raster->rows; i++) {
+        free(raster->tile[i].count);
+        free(raster->tile[i].sum);
+    }
+    free(raster->tile);
+    raster->tile = NULL;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Clip box to raster in raster pixel co-ordinates
+
+Return:
+ true  - something left
+ false - box is off the raster
+
+*/
+static int Raster_clip(Raster *raster, Box *box)
+{
+    box->min_x = MAX(box->min_x - raster->min_x, 0);
+    box->min_y = MAX(box->min_y - raster->min_y, 0);
+    box->max_x = MIN(box->max_x - raster->min_x, raster->w);
+    box->max_y = MIN(box->max_y - raster->min_y, raster->h);
+    return (box->min_x < box->max_x && box->min_y < box->max_y);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Rebuild summed area table of a raster tile, entry (x,y) holds the box count 
+summed over all pixels above and left of it
+
+*/
+static void RasterTile_sum(RasterTile *tile)
+{
+    int x,
+        y;
+    unsigned int row_sum;
+
+    for (y = 0; y < RASTER_TILE; y++) {
+        row_sum = 0;
+        for (x = 0; x < RASTER_TILE; x++) {
+            row_sum += tile->count[y * RASTER_TILE + x];
+            tile->sum[(y + 1) * (RASTER_TILE + 1) + x + 1] = 
+                tile->sum[y * (RASTER_TILE + 1) + x + 1] + row_sum;
+        }
+    }
+    tile->dirty = FALSE;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Add box to occupancy raster, or take it away with a delta of -1. Only the 
+counts of the tiles under the box change and their tables are re-summed when 
+next queried
+
+*/
+static void Raster_add(Raster *raster, Box box, int delta)
+{
+    int col,
+        row;
+    int x,
+        y;
+
+    if (!Raster_clip(raster, &box)) {
+        return;
+    }
+    for (row = box.min_y >> RASTER_TILE_SHIFT; 
+         row <= (box.max_y - 1) >> RASTER_TILE_SHIFT; row++) {
+        for (col = box.min_x >> RASTER_TILE_SHIFT; 
+             col <= (box.max_x - 1) >> RASTER_TILE_SHIFT; col++) {
+            RasterTile *tile = &raster->tile[row * raster->cols + col];
+            int tile_x = col << RASTER_TILE_SHIFT;
+            int tile_y = row << RASTER_TILE_SHIFT;
+
+            if (tile->count == NULL) {
+                tile->count = (unsigned int *) calloc(RASTER_TILE * RASTER_TILE,
+                                                      sizeof (unsigned int));
+                tile->sum = (unsigned int *) calloc((RASTER_TILE + 1) * 
+                                                    (RASTER_TILE + 1),
+                                                    sizeof (unsigned int));
+                if (tile->count == NULL || tile->sum == NULL) {
+                    fprintf(stderr,"**** Error out of memory for occupancy raster\n**** Aborting\n");
+                    exit(1);
+                }
+            }
+            for (y = MAX(box.min_y, tile_y) - tile_y;
+                 y < MIN(box.max_y, tile_y + RASTER_TILE) - tile_y; y++) {
+                for (x = MAX(box.min_x, tile_x) - tile_x;
+                     x < MIN(box.max_x, tile_x + RASTER_TILE) - tile_x; x++) {
+                    tile->count[y * RASTER_TILE + x] += delta;
+                }
+            }
+            tile->dirty = TRUE;
+        }
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Add or take away a segment in the occupancy raster, counting the pixels whose
+centres are inside it
+
+*/
+static void Raster_addSegment(Raster *raster, Segment seg, int delta)
+{
+    double dx = seg.line.end.x - seg.line.start.x;
+    double dy = seg.line.end.y - seg.line.start.y;
+    double half_length = sqrt(dx * dx + dy * dy) / 2.0;
+    double mid_x = (seg.line.start.x + seg.line.end.x) / 2.0;
+    double mid_y = (seg.line.start.y + seg.line.end.y) / 2.0;
+    double along,
+           across;
+    int x,
+        y,
+        start;
+
+    if (half_length > 0.0) {
+        dx /= 2.0 * half_length;
+        dy /= 2.0 * half_length;
+    }else{
+        dx = 1.0;
+        dy = 0.0;
+    }
+    for (y = seg.bounds.min_y; y < seg.bounds.max_y; y++) {
+        start = INT_MAX;
+        for (x = seg.bounds.min_x; x <= seg.bounds.max_x; x++) {
+            along = (x + 0.5 - mid_x) * dx + (y + 0.5 - mid_y) * dy;
+            across = (y + 0.5 - mid_y) * dx - (x + 0.5 - mid_x) * dy;
+            if (x < seg.bounds.max_x && 
+                fabs(along) <= half_length + seg.thickness && 
+                fabs(across) <= seg.thickness) {
+                start = MIN(start, x);
+            }else if (start != INT_MAX) {
+                Raster_add(raster, Box_boxInt(start, y, x, y + 1), delta);
+                start = INT_MAX;
+            }
+        }
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Re-sum every changed tile, after this queries don't modify the raster
+
+*/
+static void Raster_flush(Raster *raster)
+{
+    int i;
+
+    for (i = 0; i < raster->cols * raster->rows; i++) {
+        if (raster->tile[i].dirty) {
+            RasterTile_sum(&raster->tile[i]);
+        }
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Get the area of overlap between a box and the occupancy raster, four table 
+lookups per tile the box spans whatever the number of boxes
+
+Return:
+ overlap area
+
+*/
+static int Raster_overlap(Raster *raster, Box box)
+{
+    int col,
+        row;
+    unsigned int total = 0;
+
+    if (!Raster_clip(raster, &box)) {
+        return 0;
+    }
+    for (row = box.min_y >> RASTER_TILE_SHIFT; 
+         row <= (box.max_y - 1) >> RASTER_TILE_SHIFT; row++) {
+        for (col = box.min_x >> RASTER_TILE_SHIFT; 
+             col <= (box.max_x - 1) >> RASTER_TILE_SHIFT; col++) {
+            RasterTile *tile = &raster->tile[row * raster->cols + col];
+            int tile_x = col << RASTER_TILE_SHIFT;
+            int tile_y = row << RASTER_TILE_SHIFT;
+            int x0,
+                y0,
+                x1,
+                y1;
+
+            if (tile->count == NULL) {
+                continue;
+            }
+            if (tile->dirty) {
+                RasterTile_sum(tile);
+            }
+            x0 = MAX(box.min_x, tile_x) - tile_x;
+            y0 = MAX(box.min_y, tile_y) - tile_y;
+            x1 = MIN(box.max_x, tile_x + RASTER_TILE) - tile_x;
+            y1 = MIN(box.max_y, tile_y + RASTER_TILE) - tile_y;
+            total += tile->sum[y1 * (RASTER_TILE + 1) + x1]
+                   - tile->sum[y0 * (RASTER_TILE + 1) + x1]
+                   - tile->sum[y1 * (RASTER_TILE + 1) + x0]
+                   + tile->sum[y0 * (RASTER_TILE + 1) + x0];
+        }
+    }
+    return (int) total;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Create box index covering the area using the grid or the occupancy raster
+
+*/
+static void BoxIndex_init(BoxIndex *index, int x, int y, int w, int h)
+{
+    if (summed_area) {
+        Raster_init(&index->raster, x, y, w, h);
+    }else{
+        BoxGrid_init(&index->grid, x, y, w, h);
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Free box index
+
+*/
+static void BoxIndex_free(BoxIndex *index)
+{
+    if (summed_area) {
+        Raster_free(&index->raster);
+    }else{
+        BoxGrid_free(&index->grid);
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Add box to box index
+
+*/
+static void BoxIndex_add(BoxIndex *index, Box box)
+{
+    if (summed_area) {
+        Raster_add(&index->raster, box, 1);
+    }else{
+        BoxGrid_add(&index->grid, box);
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Remove box from box index
+
+*/
+static void BoxIndex_remove(BoxIndex *index, Box box)
+{
+    if (summed_area) {
+        Raster_add(&index->raster, box, -1);
+    }else{
+        BoxGrid_remove(&index->grid, box);
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Add mask to box index at x,y, the occupancy raster counts each run of covered 
+pixels
+
+*/
+static void BoxIndex_addMask(BoxIndex *index, Mask *mask, int x, int y)
+{
+    int mx,
+        my,
+        start;
+
+    if (!summed_area) {
+        BoxGrid_addMask(&index->grid, mask, x, y);
+        return;
+    }
+    for (my = 0; my < mask->h; my++) {
+        uint64_t *row = mask->bits + my * mask->words;
+
+        for (mx = 0; mx < mask->w; mx++) {
+            if (row[mx / 64] >> (mx % 64) & 1) {
+                for (start = mx; mx < mask->w && (row[mx / 64] >> (mx % 64) & 1); 
+                     mx++);
+                Raster_add(&index->raster, 
+                           Box_boxInt(x + start, y + my, x + mx, y + my + 1), 1);
+            }
+        }
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Add or remove segment in box index
+
+*/
+static void BoxIndex_addSegment(BoxIndex *index, Segment seg, int add)
+{
+    if (summed_area) {
+        Raster_addSegment(&index->raster, seg, add ? 1 : -1);
+    }else{
+        BoxGrid_addSegment(&index->grid, seg, add);
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Get the clash of a text box and a weighted leader box with the boxes in a box
+index and an optional overlay index on top of it. The grid weights each box 
+and gives up once the total reaches the bound, the occupancy raster can only 
+weight the leader total
+
+Return:
+ weighted overlap area, or a value >= bound
+
+*/
+static int BoxIndex_overlap(BoxIndex *index, BoxIndex *overlay, Box text, 
+                            Box leader, double weighting, int bound)
+{
+    int total;
+    int leader_total;
+
+    if (summed_area) {
+        total = Raster_overlap(&index->raster, text);
+        if (overlay) {
+            total += Raster_overlap(&overlay->raster, text);
+        }
+        if (weighting != 0.0 && total < bound) {
+            leader_total = Raster_overlap(&index->raster, leader);
+            if (overlay) {
+                leader_total += Raster_overlap(&overlay->raster, leader);
+            }
+            total += (int) (leader_total * weighting);
+        }
+        return total;
+    }
+    total = BoxGrid_overlap(&index->grid, text, leader, weighting, bound);
+    if (overlay && total < bound) {
+        total += BoxGrid_overlap(&overlay->grid, text, leader, weighting, 
+                                 bound - total);
+    }
+    return total;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Create box manager for map of given size
+
+*/
+void BoxMgr_init(int width, int height)
+{
+    /* pick the widest clash kernel the cpu runs
+     */
+#ifdef BOX_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        BoxList_overlap = BoxList_overlapAvx2;
+        if (verbose) printf("clash kernel         avx2\n");
+    }else if (__builtin_cpu_supports("sse2")) {
+        BoxList_overlap = BoxList_overlapSse2;
+        if (verbose) printf("clash kernel         sse2\n");
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+        MaskList_overlap = MaskList_overlapPopcnt;
+    }
+#endif
+
+    /* the raster extends past the map edges to hold the edge clash boxes
+     */
+    if (summed_area) {
+        BoxIndex_init(&clash_index, -EDGE_DILATION, -EDGE_DILATION,
+                      width + 2 * EDGE_DILATION, height + 2 * EDGE_DILATION);
+    }else{
+        BoxIndex_init(&clash_index, 0, 0, width, height);
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Add box to box manager
+
+*/
+void BoxMgr_add(Box box)
+{
+   BoxList_add(&clash_boxes, box, 0);
+   BoxIndex_add(&clash_index, box);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Add the covered pixels of a mask to the box manager for an image with its top 
+left at x,y, used for game object images. Only the bounding box of the 
+covered pixels is kept for drawing
+
+*/
+void BoxMgr_addMask(Mask *mask, int x, int y)
+{
+   x += mask->x;
+   y += mask->y;
+   BoxList_add(&clash_boxes, Box_boxInt(x, y, x + mask->w, y + mask->h), 0);
+   BoxIndex_addMask(&clash_index, mask, x, y);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Add a thick line segment to the box manager, used for lines. Only the 
+bounding box is kept for drawing
+
+*/
+void BoxMgr_addSegment(Segment seg)
+{
+   BoxList_add(&clash_boxes, seg.bounds, 0);
+   BoxIndex_addSegment(&clash_index, seg, TRUE);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Finish any deferred work in the box manager, after this queries only read it
+and are safe to run from several threads at once
+
+*/
+void BoxMgr_flush(void)
+{
+   if (summed_area) {
+       Raster_flush(&clash_index.raster);
+   }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Create a private overlay for the box manager covering an area, boxes added to
+the overlay are seen only by queries given the overlay
+
+*/
+BoxIndex *BoxMgr_newOverlay(Box area)
+{
+   BoxIndex *overlay;
+
+   overlay = (BoxIndex *) malloc(sizeof (BoxIndex));
+   if (overlay == NULL) {
+       fprintf(stderr,"**** Error out of memory for clash boxes\n**** Aborting\n");
+       exit(1);
+   }
+   BoxIndex_init(overlay, area.min_x, area.min_y, area.max_x - area.min_x, 
+                 area.max_y - area.min_y);
+   return overlay;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Add box to a box manager overlay
+
+*/
+void BoxMgr_addOverlay(BoxIndex *overlay, Box box)
+{
+   BoxIndex_add(overlay, box);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Remove a box added to a box manager overlay
+
+*/
+void BoxMgr_removeOverlay(BoxIndex *overlay, Box box)
+{
+   BoxIndex_remove(overlay, box);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Add and remove a segment in a box manager overlay
+
+*/
+void BoxMgr_addSegmentOverlay(BoxIndex *overlay, Segment seg)
+{
+   BoxIndex_addSegment(overlay, seg, TRUE);
+}
+
+void BoxMgr_removeSegmentOverlay(BoxIndex *overlay, Segment seg)
+{
+   BoxIndex_addSegment(overlay, seg, FALSE);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Free box manager overlay
+
+*/
+void BoxMgr_freeOverlay(BoxIndex *overlay)
+{
+   BoxIndex_free(overlay);
+   free(overlay);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Get the area of overlap between a box and the boxes in the box manager
+
+Return:
+ overlap area
+
+*/
+int BoxMgr_overlap(Box box)
+{
+   return BoxIndex_overlap(&clash_index, NULL, box, box, 0.0, INT_MAX);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Get the clash of a label with the boxes in the box manager plus an optional 
+overlay. The text box counts in full and the leader line box is weighted, as
+leader lines matter less than text, a weighting of 0 ignores the leader. 
+Gives up once the total reaches the bound, used to throw away candidate 
+positions that can't beat the best found so far
+
+Return:
+ weighted overlap area, or a value >= bound
+
+*/
+int BoxMgr_labelOverlap(BoxIndex *overlay, Box text, Box leader, 
+                        double weighting, int bound)
+{
+   return BoxIndex_overlap(&clash_index, overlay, text, leader, weighting, bound);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Draw boxes in box manager
+
+*/
+void BoxMgr_draw(gdImagePtr im)
+{
+   int i;
+
+   for (i=0; i < clash_boxes.num; i++) {
+       Box_draw(BoxList_get(&clash_boxes, i),im);
+   }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Get specified box from box manager 
+
+*/
+Box BoxMgr_get(int box_number)
+{
+   return BoxList_get(&clash_boxes, box_number);   
+}
+
+/*
+------------------------------------------------------------------------------
+Get the palette entry of a color in an image, allocating it if it isn't 
+there or the closest entry if the palette is full
+
+*/
+int Palette_color(gdImagePtr im, int r, int g, int b)
+{
+    int c;
+
+    c = gdImageColorExact(im, r, g, b);
+    if (c == -1) {
+        c = gdImageColorAllocate(im, r, g, b);
+        if (c == -1) {
+            c = gdImageColorClosest(im, r, g, b);
+        }
+    }
+    return c;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Change colors in an image, useful for coloring an image or inverting it. The 
+image is palettised so only its palette entries are changed, every entry of 
+the from color takes the to color and if swapping every entry of the to color
+takes the from color. The colors are matched by rgb value not index, so 
+pixels look just as if each had been set to the other entry
+
+*/
+void Palette_recolor(gdImagePtr im, int from_color, int to_color, int swap) 
+{
+    int fr, fg, fb,
+        tr, tg, tb;
+    int c;
+
+    fr = gdImageRed(im, from_color);
+    fg = gdImageGreen(im, from_color);
+    fb = gdImageBlue(im, from_color);
+    tr = gdImageRed(im, to_color);
+    tg = gdImageGreen(im, to_color);
+    tb = gdImageBlue(im, to_color);
+    for (c = 0; c < gdImageColorsTotal(im); c++) {
+        if (im->open[c]) {
+            continue;
+        }
+        if (im->red[c] == fr && im->green[c] == fg && im->blue[c] == fb) {
+            im->red[c] = tr;
+            im->green[c] = tg;
+            im->blue[c] = tb;
+        }else if (swap && im->red[c] == tr && im->green[c] == tg && im->blue[c] == tb) {
+            im->red[c] = fr;
+            im->green[c] = fg;
+            im->blue[c] = fb;
+        }
+    }
+}
+
+
+/* changeForeground
+------------------------------------------------------------------------------
+Change image foreground color - assumes the foreground is white
+
+*/
+		
+void changeForeground(gdImagePtr im)
+{
+	int new_f;
+	int old_f;
+	
+	if (verbose) printf("Changing foreground colour\n");
+
+	/* get foreground color and get best match in image
+	 */
+	new_f = Palette_color(im, gdImageRed(im_out,foreground_color),
+	                      gdImageGreen(im_out,foreground_color),
+	                      gdImageBlue(im_out,foreground_color));
+
+	/* get old foreground color (white)  best match in image
+	 */
+	old_f = Palette_color(im,255,255,255);
+
+	/* change old foreground for new foreground
+	 */
+	Palette_recolor(im,old_f,new_f,0);
+}
+
+
+/* Sprite_foreground
+------------------------------------------------------------------------------
+Change the foreground of a sprite image to the map foreground color, only 
+the first time for the color
+
+*/
+void Sprite_foreground(Sprite *sprite)
+{
+    if (sprite->foreground != foreground_color) {
+        changeForeground(sprite->image);
+        sprite->foreground = foreground_color;
+    }
+}
+
+
+/* Sprite_remap
+------------------------------------------------------------------------------
+Get the table mapping the sprite palette to the map colors of a tint. Each 
+entry takes the tint at the entry's brightest channel against the brightest 
+channel of the foreground the white of the gif was changed to, so the 
+foreground takes the tint itself and anti-aliased edges darker shades of it 
+whatever the foreground color. A table is built the first time a sprite is 
+drawn with a tint and kept with the sprite
+
+*/
+Remap *Sprite_remap(Sprite *sprite, int tint)
+{
+    Remap *remap;
+    int full;
+    int level;
+    int c;
+
+    for (remap = sprite->remap; remap; remap = remap->next) {
+        if (remap->tint == tint) {
+            return remap;
+        }
+    }
+    if (sprite->foreground != NOT_DEFINED) {
+        full = MAX(gdImageRed(im_out, sprite->foreground), 
+                   MAX(gdImageGreen(im_out, sprite->foreground), 
+                       gdImageBlue(im_out, sprite->foreground)));
+    } else {
+        full = MAX(foreground_rgb.r, MAX(foreground_rgb.g, foreground_rgb.b));
+    }
+    if (full == 0) {
+        /* a black foreground leaves no shading to go by */
+        full = 255;
+    }
+    remap = (Remap *) malloc(sizeof (Remap));
+    remap->tint = tint;
+    for (c = 0; c < gdImageColorsTotal(sprite->image); c++) {
+        level = MAX(gdImageRed(sprite->image, c), 
+                    MAX(gdImageGreen(sprite->image, c), gdImageBlue(sprite->image, c)));
+        level = MIN(255, level * 255 / full);
+        remap->color[c] = Palette_color(im_out, (tint >> 16 & 0xff) * level / 255,
+                                        (tint >> 8 & 0xff) * level / 255,
+                                        (tint & 0xff) * level / 255);
+    }
+    remap->next = sprite->remap;
+    sprite->remap = remap;
+    return remap;
+}
+
+
+/* Sprite_drawTinted
+------------------------------------------------------------------------------
+Draw a sprite centred at x,y in a tint. Like gdImageCopy the transparent 
+pixels are skipped but the others are set straight from the remap table
+
+*/
+void Sprite_drawTinted(gdImagePtr im, Sprite *sprite, int x, int y, int tint)
+{
+    Remap *remap;
+    unsigned char *column;
+    int transparent;
+    int xs,
+        ys;
+    int xd,
+        yd;
+
+    remap = Sprite_remap(sprite, tint);
+    transparent = gdImageGetTransparent(sprite->image);
+    for (xs = 0; xs < sprite->mask->w; xs++) {
+        xd = x + sprite->off_x + xs;
+        if (xd < 0 || xd >= gdImageSX(im)) {
+            continue;
+        }
+        column = sprite->image->pixels[xs];
+        for (ys = 0; ys < sprite->mask->h; ys++) {
+            yd = y + sprite->off_y + ys;
+            if (column[ys] != transparent && yd >= 0 && yd < gdImageSY(im)) {
+                im->pixels[xd][yd] = remap->color[column[ys]];
+            }
+        }
+    }
+}
+
+
+
+
+/* Spin_fixed
+------------------------------------------------------------------------------
+Convert to and from the fixed point sprite rotation co-ordinates, rounding to
+a pixel the same way as Rint
+
+*/
+static int64_t Spin_fixed(double v)
+{
+    return (int64_t) floor(v * (double) ((int64_t) 1 << SPIN_SHIFT) + 0.5);
+}
+
+static ALWAYS_INLINE int Spin_round(int64_t v)
+{
+    if (v < 0) {
+        return -(int) ((-v + SPIN_HALF) >> SPIN_SHIFT);
+    }
+    return (int) ((v + SPIN_HALF) >> SPIN_SHIFT);
+}
+
+
+/* Spin_size
+------------------------------------------------------------------------------
+Get the side of the square image spinImage makes from an image size and 
+scale, big enough for any heading
+
+*/
+int Spin_size(int sx, int sy, double scale)
+{
+    return (int) (0.9999 + scale * sqrt((double) (sx * sx + sy * sy)));
+}
+
+
+/* Spin_init
+------------------------------------------------------------------------------
+Set up the rotation of an image by angle and scale. Rotating and scaling is 
+an affine map, an output pixel dx,dy from the output centre samples the input
+at
+
+    xq = ( dx * cos(angle) + dy * sin(angle)) / scale + in_xcen
+    yq = (-dx * sin(angle) + dy * cos(angle)) / scale + in_ycen
+
+so the input point can be stepped down an output column by a constant and
+the resampling probes, across by across from -0.4 to +0.4 of a pixel, are 
+constant offsets from it. One probe across point samples
+
+*/
+static void Spin_init(Spin *spin, gdImagePtr im_in, double angle, double scale,
+                      int across)
+{
+    int xsup,
+        ysup;
+    double ox,
+           oy;
+
+    spin->im_in = im_in;
+    spin->plane = NULL;
+    spin->in_xcen = im_in->sx / 2;
+    spin->in_ycen = im_in->sy / 2;
+    spin->out_l = Spin_size(im_in->sx, im_in->sy, scale);
+    spin->out_xcen = spin->out_l / 2;
+    spin->out_ycen = spin->out_l / 2;
+    spin->cos_s = cos(angle) / scale;
+    spin->sin_s = sin(angle) / scale;
+    spin->step_x = Spin_fixed(spin->sin_s);
+    spin->step_y = Spin_fixed(spin->cos_s);
+    spin->num_samples = 0;
+    for (xsup = 0; xsup < across; xsup++) {
+        for (ysup = 0; ysup < across; ysup++) {
+            ox = across > 1 ? xsup * (0.8 / (across - 1)) - 0.4 : 0.0;
+            oy = across > 1 ? ysup * (0.8 / (across - 1)) - 0.4 : 0.0;
+            spin->probe_x[spin->num_samples] = ox;
+            spin->probe_y[spin->num_samples] = oy;
+            spin->offset_x[spin->num_samples] = 
+                Spin_fixed(ox * spin->cos_s + oy * spin->sin_s);
+            spin->offset_y[spin->num_samples] = 
+                Spin_fixed(oy * spin->cos_s - ox * spin->sin_s);
+            spin->num_samples++;
+        }
+    }
+}
+
+
+/* Spin_column
+------------------------------------------------------------------------------
+Get the fixed point input point for the top of an output column
+
+*/
+static void Spin_column(Spin *spin, int xp, int64_t *fx, int64_t *fy)
+{
+    *fx = Spin_fixed((xp - spin->out_xcen) * spin->cos_s - 
+                     spin->out_ycen * spin->sin_s + spin->in_xcen);
+    *fy = Spin_fixed(-spin->out_ycen * spin->cos_s - 
+                     (xp - spin->out_xcen) * spin->sin_s + spin->in_ycen);
+}
+
+
+/* Spin_reference
+------------------------------------------------------------------------------
+Get the input point for an output point the original way, from its polar 
+co-ordinates about the output centre, before rounding
+
+*/
+static void Spin_reference(Spin *spin, double angle, double scale, 
+                           double xout, double yout, double *xq, double *yq)
+{
+    double r,
+           angle_p,
+           angle_q;
+
+    r = sqrt((double) ((xout - spin->out_xcen) * (xout - spin->out_xcen)
+                       + (yout - spin->out_ycen) * 
+                       (yout - spin->out_ycen))) / scale;
+    if ( r > MIN_RADIUS ) { 
+        angle_p = atan2(yout - (double)spin->out_ycen, 
+                        xout - (double)spin->out_xcen);
+    }else{
+        angle_p = 0.0;
+    }
+    angle_q = angle_p - angle;
+    *xq = r * cos(angle_q) + (double)spin->in_xcen;
+    *yq = r * sin(angle_q) + (double)spin->in_ycen;
+}
+
+
+/* SpinPlane_init
+------------------------------------------------------------------------------
+Expand an image to a plane of packed colors for the vector resampling 
+kernels, red in the low byte then green and blue, with the top byte 1 inside
+the image. The plane is padded with empty pixels far enough that no probe of
+any heading at the scale, even past the end of a column, can leave it. The 
+plane is left empty if the scale makes it too big, the scalar kernel is used
+
+*/
+void SpinPlane_init(SpinPlane *plane, gdImagePtr im_in, double scale)
+{
+    double reach;
+    int width,
+        height;
+    int incol;
+    int x,
+        y;
+
+    plane->pixel = NULL;
+    if (!(scale > 0.0)) {
+        return;
+    }
+
+    /* an input point is at most (|cos| + |sin|) / scale, under 1.415 / scale,
+     * times the output offset from the centre away from the input centre
+     */
+    reach = (Spin_size(im_in->sx, im_in->sy, scale) / 2.0 + SPIN_LANES + 2) * 1.415 / scale + 2;
+    plane->pad_x = MAX(0, (int) ceil(reach - im_in->sx / 2)) + 2;
+    plane->pad_y = MAX(0, (int) ceil(reach - im_in->sy / 2)) + 2;
+    width = im_in->sx + 2 * plane->pad_x;
+    height = im_in->sy + 2 * plane->pad_y;
+    if ((double) width * height > SPIN_PLANE_MAX) {
+        return;
+    }
+    plane->stride = height;
+    plane->pixel = (uint32_t *) calloc((size_t) width * height, sizeof (uint32_t));
+    if (plane->pixel == NULL) {
+        return;
+    }
+    for (x = 0; x < im_in->sx; x++) {
+        for (y = 0; y < im_in->sy; y++) {
+            incol = gdImageGetPixel(im_in, x, y);
+            plane->pixel[(size_t) (x + plane->pad_x) * height + y + plane->pad_y] =
+                (uint32_t) gdImageRed(im_in, incol) | 
+                (uint32_t) gdImageGreen(im_in, incol) << 8 |
+                (uint32_t) gdImageBlue(im_in, incol) << 16 | 
+                (uint32_t) 1 << 24;
+        }
+    }
+}
+
+
+/* Spin_samplesScalar
+------------------------------------------------------------------------------
+Sum the probes of SPIN_LANES pixels down an output column from the input 
+point fx,fy of the first, this is the reference the vector kernels match
+
+*/
+static void Spin_samplesScalar(Spin *spin, int64_t fx, int64_t fy, SpinSums *sums)
+{
+    int incol;
+    int xq,
+        yq;
+    int lane;
+    int n;
+
+    for (lane = 0; lane < SPIN_LANES; lane++, fx += spin->step_x, fy += spin->step_y) {
+        sums->red[lane] = 0;
+        sums->green[lane] = 0;
+        sums->blue[lane] = 0;
+        sums->count[lane] = 0;
+        for (n = 0; n < spin->num_samples; n++) {
+            xq = Spin_round(fx + spin->offset_x[n]);
+            yq = Spin_round(fy + spin->offset_y[n]);
+            if (gdImageBoundsSafe(spin->im_in, xq, yq)) {
+                sums->count[lane]++;
+                incol = gdImageGetPixel(spin->im_in, xq, yq);
+                sums->red[lane] += gdImageRed(spin->im_in, incol);
+                sums->green[lane] += gdImageGreen(spin->im_in, incol);
+                sums->blue[lane] += gdImageBlue(spin->im_in, incol);
+            }
+        }
+    }
+}
+
+#ifdef BOX_SIMD
+
+/*
+------------------------------------------------------------------------------
+Round 4 fixed point co-ordinates held as 64 bit pairs in a and b to pixels 
+the same way as Spin_round. With hi the whole part, floor, and lo the 
+fraction that is hi plus one if lo is over a half, or exactly a half and the
+co-ordinate isn't negative
+
+*/
+__attribute__((target("sse2")))
+static __m128i sse2_spinRound(__m128i a, __m128i b)
+{
+    __m128i lo = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), 
+                                                 _mm_castsi128_ps(b), 
+                                                 _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i hi = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), 
+                                                 _mm_castsi128_ps(b), 
+                                                 _MM_SHUFFLE(3, 1, 3, 1)));
+    __m128i half = _mm_xor_si128(lo, _mm_set1_epi32(INT32_MIN));
+    __m128i zero = _mm_setzero_si128();
+    __m128i up;
+
+    up = _mm_or_si128(_mm_cmpgt_epi32(half, zero),
+                      _mm_and_si128(_mm_cmpeq_epi32(half, zero),
+                                    _mm_cmpgt_epi32(hi, _mm_set1_epi32(-1))));
+    return _mm_sub_epi32(hi, up);
+}
+
+/*
+------------------------------------------------------------------------------
+SSE2 version of Spin_samplesScalar, 4 lanes at a time from the color plane.
+The red and blue sums share one 32 bit lane as do green and the count, 25 
+probes of 255 fit in 16 bits
+
+*/
+__attribute__((target("sse2")))
+static void Spin_samplesSse2(Spin *spin, int64_t fx, int64_t fy, SpinSums *sums)
+{
+    SpinPlane *plane = spin->plane;
+    uint32_t gathered[4] __attribute__((aligned(16)));
+    int32_t index[4] __attribute__((aligned(16)));
+    __m128i low_bytes = _mm_set1_epi32(0x00ff00ff);
+    __m128i stride = _mm_set1_epi32(plane->stride);
+    __m128i pad_x = _mm_set1_epi32(plane->pad_x);
+    __m128i pad_y = _mm_set1_epi32(plane->pad_y);
+    __m128i x01, x23,
+            y01, y23;
+    __m128i ox, oy;
+    __m128i xq, yq;
+    __m128i pixel;
+    __m128i red_blue,
+            green_count;
+    int32_t rb[4] __attribute__((aligned(16)));
+    int32_t gc[4] __attribute__((aligned(16)));
+    int lane;
+    int quad;
+    int n;
+
+    for (quad = 0; quad < SPIN_LANES; quad += 4) {
+        x01 = _mm_set_epi64x(fx + spin->step_x, fx);
+        x23 = _mm_set_epi64x(fx + 3 * spin->step_x, fx + 2 * spin->step_x);
+        y01 = _mm_set_epi64x(fy + spin->step_y, fy);
+        y23 = _mm_set_epi64x(fy + 3 * spin->step_y, fy + 2 * spin->step_y);
+        red_blue = _mm_setzero_si128();
+        green_count = _mm_setzero_si128();
+        for (n = 0; n < spin->num_samples; n++) {
+            ox = _mm_set1_epi64x(spin->offset_x[n]);
+            oy = _mm_set1_epi64x(spin->offset_y[n]);
+            xq = _mm_add_epi32(sse2_spinRound(_mm_add_epi64(x01, ox), 
+                                              _mm_add_epi64(x23, ox)), pad_x);
+            yq = _mm_add_epi32(sse2_spinRound(_mm_add_epi64(y01, oy), 
+                                              _mm_add_epi64(y23, oy)), pad_y);
+            _mm_store_si128((__m128i *) index, 
+                            _mm_add_epi32(sse2_mul(xq, stride), yq));
+            for (lane = 0; lane < 4; lane++) {
+                gathered[lane] = plane->pixel[index[lane]];
+            }
+            pixel = _mm_load_si128((__m128i *) gathered);
+            red_blue = _mm_add_epi32(red_blue, _mm_and_si128(pixel, low_bytes));
+            green_count = _mm_add_epi32(green_count, 
+                                        _mm_and_si128(_mm_srli_epi32(pixel, 8), 
+                                                      low_bytes));
+        }
+        _mm_store_si128((__m128i *) rb, red_blue);
+        _mm_store_si128((__m128i *) gc, green_count);
+        for (lane = 0; lane < 4; lane++) {
+            sums->red[quad + lane] = rb[lane] & 0xffff;
+            sums->blue[quad + lane] = rb[lane] >> 16;
+            sums->green[quad + lane] = gc[lane] & 0xffff;
+            sums->count[quad + lane] = gc[lane] >> 16;
+        }
+        fx += 4 * spin->step_x;
+        fy += 4 * spin->step_y;
+    }
+}
+
+/*
+------------------------------------------------------------------------------
+AVX2 version of Spin_samplesScalar, all 8 lanes at once with a hardware 
+gather. Lanes 0, 1, 4 and 5 are held in one register of 64 bit co-ordinates
+and 2, 3, 6 and 7 in the other so the in lane shuffles put them in order
+
+*/
+__attribute__((target("avx2")))
+static __m256i avx2_spinRound(__m256i a, __m256i b)
+{
+    __m256i lo = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(a), 
+                                                       _mm256_castsi256_ps(b), 
+                                                       _MM_SHUFFLE(2, 0, 2, 0)));
+    __m256i hi = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(a), 
+                                                       _mm256_castsi256_ps(b), 
+                                                       _MM_SHUFFLE(3, 1, 3, 1)));
+    __m256i half = _mm256_xor_si256(lo, _mm256_set1_epi32(INT32_MIN));
+    __m256i zero = _mm256_setzero_si256();
+    __m256i up;
+
+    up = _mm256_or_si256(_mm256_cmpgt_epi32(half, zero),
+                         _mm256_and_si256(_mm256_cmpeq_epi32(half, zero),
+                                          _mm256_cmpgt_epi32(hi, _mm256_set1_epi32(-1))));
+    return _mm256_sub_epi32(hi, up);
+}
+
+__attribute__((target("avx2")))
+static void Spin_samplesAvx2(Spin *spin, int64_t fx, int64_t fy, SpinSums *sums)
+{
+    SpinPlane *plane = spin->plane;
+    __m256i low_bytes = _mm256_set1_epi32(0x00ff00ff);
+    __m256i stride = _mm256_set1_epi32(plane->stride);
+    __m256i pad_x = _mm256_set1_epi32(plane->pad_x);
+    __m256i pad_y = _mm256_set1_epi32(plane->pad_y);
+    __m256i xa, xb,
+            ya, yb;
+    __m256i ox, oy;
+    __m256i xq, yq;
+    __m256i pixel;
+    __m256i red_blue = _mm256_setzero_si256(),
+            green_count = _mm256_setzero_si256();
+    int32_t rb[8] __attribute__((aligned(32)));
+    int32_t gc[8] __attribute__((aligned(32)));
+    int lane;
+    int n;
+
+    xa = _mm256_set_epi64x(fx + 5 * spin->step_x, fx + 4 * spin->step_x, 
+                           fx + spin->step_x, fx);
+    xb = _mm256_set_epi64x(fx + 7 * spin->step_x, fx + 6 * spin->step_x, 
+                           fx + 3 * spin->step_x, fx + 2 * spin->step_x);
+    ya = _mm256_set_epi64x(fy + 5 * spin->step_y, fy + 4 * spin->step_y, 
+                           fy + spin->step_y, fy);
+    yb = _mm256_set_epi64x(fy + 7 * spin->step_y, fy + 6 * spin->step_y, 
+                           fy + 3 * spin->step_y, fy + 2 * spin->step_y);
+    for (n = 0; n < spin->num_samples; n++) {
+        ox = _mm256_set1_epi64x(spin->offset_x[n]);
+        oy = _mm256_set1_epi64x(spin->offset_y[n]);
+        xq = _mm256_add_epi32(avx2_spinRound(_mm256_add_epi64(xa, ox), 
+                                             _mm256_add_epi64(xb, ox)), pad_x);
+        yq = _mm256_add_epi32(avx2_spinRound(_mm256_add_epi64(ya, oy), 
+                                             _mm256_add_epi64(yb, oy)), pad_y);
+        pixel = _mm256_i32gather_epi32((const int *) plane->pixel, 
+                                       _mm256_add_epi32(_mm256_mullo_epi32(xq, stride), yq), 
+                                       4);
+        red_blue = _mm256_add_epi32(red_blue, _mm256_and_si256(pixel, low_bytes));
+        green_count = _mm256_add_epi32(green_count, 
+                                       _mm256_and_si256(_mm256_srli_epi32(pixel, 8), 
+                                                        low_bytes));
+    }
+    _mm256_store_si256((__m256i *) rb, red_blue);
+    _mm256_store_si256((__m256i *) gc, green_count);
+    for (lane = 0; lane < 8; lane++) {
+        sums->red[lane] = rb[lane] & 0xffff;
+        sums->blue[lane] = rb[lane] >> 16;
+        sums->green[lane] = gc[lane] & 0xffff;
+        sums->count[lane] = gc[lane] >> 16;
+    }
+}
+
+#endif
+
+/* resampling kernel chosen for the cpu by Spin_chooseKernel */
+static void (*Spin_samples)(Spin *spin, int64_t fx, int64_t fy, 
+                            SpinSums *sums) = Spin_samplesScalar;
+char *spin_kernel = "scalar";
+
+
+/* Spin_chooseKernel
+------------------------------------------------------------------------------
+Pick the widest resampling kernel the cpu runs, before any sprite is made
+
+*/
+void Spin_chooseKernel()
+{
+#ifdef BOX_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        Spin_samples = Spin_samplesAvx2;
+        spin_kernel = "avx2";
+    }else if (__builtin_cpu_supports("sse2")) {
+        Spin_samples = Spin_samplesSse2;
+        spin_kernel = "sse2";
+    }
+#endif
+    if (verbose) printf("rotation kernel      %s\n", spin_kernel);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Rotate and scale a game_object gif with optional resampling, the resampling
+only works on a black background. The input point of each output pixel is 
+stepped in fixed point so there is no trig per pixel, see Spin_init. Given 
+the color plane of the image the probes are summed by the SIMD kernel, 
+which gives exactly the sums of Spin_samplesScalar
+
+Note if recolouring - recolour before transforming the image
+
+*/
+gdImagePtr spinImage(gdImagePtr im_in, SpinPlane *plane, double angle, 
+                     double scale, int across)
+{
+    gdImagePtr im_out;
+    Spin spin;
+    SpinSums sums;
+    int outcol;
+    int out_trans;
+    int red,
+        green,
+        blue;
+    int last_red = -1,
+        last_green = -1,
+        last_blue = -1,
+        last_col = -1;
+    int width;
+    int xp,
+        yp;
+    int lane;
+    int64_t fx,
+            fy;
+
+    Spin_init(&spin, im_in, angle, scale, across);
+    if (plane && plane->pixel) {
+        spin.plane = plane;
+    }
+
+    /* Create output image, first color allocated is the transparent 
+     * background, black or white. An even side gets one more row and column
+     * so the image is odd and turns exactly about its centre, the extra 
+     * pixels are trimmed from the sprite
+     */
+    width = spin.out_l | 1;
+    im_out = gdImageCreate(width, width);
+    if (color) {
+        out_trans = gdImageColorAllocate(im_out, 0, 0, 0);
+    }else{
+        out_trans = gdImageColorAllocate(im_out, 255, 255, 255);
+    }
+    gdImageColorTransparent(im_out, out_trans);
+
+    /* produce rotated copy of input image in output image averaging the 
+     * probes that land in the input image, the probes are summed for several
+     * pixels down a column at once
+     */
+    for (xp = 0; xp < width; xp++) {
+        Spin_column(&spin, xp, &fx, &fy);
+        for (yp = 0; yp < width; yp += SPIN_LANES, 
+             fx += SPIN_LANES * spin.step_x, fy += SPIN_LANES * spin.step_y) {
+            if (spin.plane) {
+                Spin_samples(&spin, fx, fy, &sums);
+            }else{
+                Spin_samplesScalar(&spin, fx, fy, &sums);
+            }
+
+            /* take the mean color of the samples and get the closest match
+             * in the new image, runs of one color reuse the last match
+             */
+            for (lane = 0; lane < SPIN_LANES && yp + lane < width; lane++) {
+                if (sums.count[lane] == 0) {
+                    outcol = out_trans;
+                }else{
+                    red = sums.red[lane] / sums.count[lane];
+                    green = sums.green[lane] / sums.count[lane];
+                    blue = sums.blue[lane] / sums.count[lane];
+                    if (red != last_red || green != last_green || blue != last_blue) {
+                        last_col = gdImageColorExact(im_out, red, green, blue);
+                        if (last_col == -1) {
+                            last_col = gdImageColorAllocate(im_out, red, green, blue);
+                            if (last_col == -1) {
+                                last_col = gdImageColorClosest(im_out, red, green, 
+                                                               blue);
+                            }
+                        }
+                        last_red = red;
+                        last_green = green;
+                        last_blue = blue;
+                    }
+                    outcol = last_col;
+                }
+                gdImageSetPixel(im_out, xp, yp + lane, outcol);
+            }
+        }
+    }
+    return im_out;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Turn a square sprite image from spinImage a further 90 degrees, the same turn
+as three clock headings. Turning is exact, output pixel x,y is input pixel 
+y,2c-x about the centre c, so the sprite is only resampled once. spinImage 
+makes the side odd so every output pixel has an input pixel
+
+*/
+gdImagePtr turnImage(gdImagePtr im_in)
+{
+    gdImagePtr im_out;
+    int cen;
+    int x,
+        y;
+    int i;
+
+    im_out = gdImageCreate(im_in->sx, im_in->sy);
+    for (i = 0; i < gdImageColorsTotal(im_in); i++) {
+        gdImageColorAllocate(im_out, gdImageRed(im_in, i), gdImageGreen(im_in, i),
+                             gdImageBlue(im_in, i));
+    }
+    gdImageColorTransparent(im_out, gdImageGetTransparent(im_in));
+    cen = im_in->sx / 2;
+    for (x = 0; x < im_out->sx; x++) {
+        for (y = 0; y < im_out->sy; y++) {
+            if (gdImageBoundsSafe(im_in, y, 2 * cen - x)) {
+                gdImageSetPixel(im_out, x, y, gdImageGetPixel(im_in, y, 2 * cen - x));
+            }else{
+                gdImageSetPixel(im_out, x, y, gdImageGetTransparent(im_in));
+            }
+        }
+    }
+    return im_out;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Halve an image to the next level of a mip pyramid. Each output pixel is the 
+box filtered mean color of the 2x2 input pixels it covers, or of those 
+inside the image along an odd edge. Like spinImage the background is just 
+another color so it only works on a plain background
+
+*/
+gdImagePtr halveImage(gdImagePtr im_in)
+{
+    gdImagePtr im_out;
+    int incol;
+    int outcol = -1;
+    int count;
+    int red,
+        green,
+        blue;
+    int last_red = -1,
+        last_green = -1,
+        last_blue = -1;
+    int x,
+        y;
+    int dx,
+        dy;
+
+    im_out = gdImageCreate((im_in->sx + 1) / 2, (im_in->sy + 1) / 2);
+    for (x = 0; x < im_out->sx; x++) {
+        for (y = 0; y < im_out->sy; y++) {
+            count = red = green = blue = 0;
+            for (dx = 0; dx < 2; dx++) {
+                for (dy = 0; dy < 2; dy++) {
+                    if (gdImageBoundsSafe(im_in, 2 * x + dx, 2 * y + dy)) {
+                        incol = gdImageGetPixel(im_in, 2 * x + dx, 2 * y + dy);
+                        red += gdImageRed(im_in, incol);
+                        green += gdImageGreen(im_in, incol);
+                        blue += gdImageBlue(im_in, incol);
+                        count++;
+                    }
+                }
+            }
+            red = (red + count / 2) / count;
+            green = (green + count / 2) / count;
+            blue = (blue + count / 2) / count;
+            if (red != last_red || green != last_green || blue != last_blue) {
+                outcol = gdImageColorExact(im_out, red, green, blue);
+                if (outcol == -1) {
+                    outcol = gdImageColorAllocate(im_out, red, green, blue);
+                    if (outcol == -1) {
+                        outcol = gdImageColorClosest(im_out, red, green, blue);
+                    }
+                }
+                last_red = red;
+                last_green = green;
+                last_blue = blue;
+            }
+            gdImageSetPixel(im_out, x, y, outcol);
+        }
+    }
+    return im_out;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Check every probe spinImage takes for a sprite heading, with and without 
+resampling, against the input pixel the original polar rotation picked. The
+two can only disagree where the exact input point is half way between pixels
+and rounding error decides, those are counted separately. The sums of the 
+SIMD kernel are checked against the scalar kernel, kernel counts the pixels 
+where they don't match
+
+Return:
+ number of probes landing on a different pixel away from a tie
+
+*/
+int checkSpin(gdImagePtr im_in, SpinPlane *plane, double angle, double scale, 
+              int across, int *probes, int *ties, int *kernel)
+{
+    Spin spin;
+    SpinSums sums,
+             reference;
+    int differ = 0;
+    int mode;
+    int lane;
+    int xp,
+        yp;
+    int n;
+    int64_t fx,
+            fy;
+    double xq,
+           yq;
+
+    for (mode = 0; mode < 2; mode++) {
+        Spin_init(&spin, im_in, angle, scale, mode ? across : 1);
+        for (xp = 0; xp < spin.out_l; xp++) {
+            Spin_column(&spin, xp, &fx, &fy);
+            for (yp = 0; yp < spin.out_l; yp++, fx += spin.step_x, fy += spin.step_y) {
+                for (n = 0; n < spin.num_samples; n++) {
+                    Spin_reference(&spin, angle, scale, xp + spin.probe_x[n],
+                                   yp + spin.probe_y[n], &xq, &yq);
+                    (*probes)++;
+                    if (Spin_round(fx + spin.offset_x[n]) == (int) Rint(xq) &&
+                        Spin_round(fy + spin.offset_y[n]) == (int) Rint(yq)) {
+                        continue;
+                    }
+                    if (fabs(fabs(xq - floor(xq)) - 0.5) < SPIN_TIE ||
+                        fabs(fabs(yq - floor(yq)) - 0.5) < SPIN_TIE) {
+                        (*ties)++;
+                    }else{
+                        differ++;
+                    }
+                }
+            }
+        }
+        if (plane == NULL || plane->pixel == NULL) {
+            continue;
+        }
+        spin.plane = plane;
+        for (xp = 0; xp < spin.out_l; xp++) {
+            Spin_column(&spin, xp, &fx, &fy);
+            for (yp = 0; yp < spin.out_l; yp += SPIN_LANES, 
+                 fx += SPIN_LANES * spin.step_x, fy += SPIN_LANES * spin.step_y) {
+                Spin_samples(&spin, fx, fy, &sums);
+                Spin_samplesScalar(&spin, fx, fy, &reference);
+                for (lane = 0; lane < SPIN_LANES && yp + lane < spin.out_l; lane++) {
+                    if (sums.red[lane] != reference.red[lane] ||
+                        sums.green[lane] != reference.green[lane] ||
+                        sums.blue[lane] != reference.blue[lane] ||
+                        sums.count[lane] != reference.count[lane]) {
+                        (*kernel)++;
+                    }
+                }
+            }
+        }
+    }
+    return differ;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Check a finished sprite heading, turned or not, against the sprite the 
+original polar rotation drew, pixel by pixel over the square drawn on the 
+map. The two can only differ at pixels with a probe half way between input 
+pixels, where rounding error decided the original, those are counted as 
+ties
+
+Return:
+ number of pixels differing away from a tie
+
+*/
+int checkSprite(gdImagePtr im_in, double angle, double scale, int across, 
+                Sprite *sprite, int *ties)
+{
+    Spin spin;
+    int differ = 0;
+    int side;
+    int tie;
+    int count;
+    int incol;
+    int red,
+        green,
+        blue;
+    int want,
+        got;
+    int xp,
+        yp;
+    int xs,
+        ys;
+    int n;
+    double xq,
+           yq;
+
+    Spin_init(&spin, im_in, angle, scale, across);
+    side = 2 * (spin.out_l / 2);
+    for (xp = 0; xp < side; xp++) {
+        for (yp = 0; yp < side; yp++) {
+            tie = FALSE;
+            count = red = green = blue = 0;
+            for (n = 0; n < spin.num_samples; n++) {
+                Spin_reference(&spin, angle, scale, xp + spin.probe_x[n],
+                               yp + spin.probe_y[n], &xq, &yq);
+                if (fabs(fabs(xq - floor(xq)) - 0.5) < SPIN_TIE ||
+                    fabs(fabs(yq - floor(yq)) - 0.5) < SPIN_TIE) {
+                    tie = TRUE;
+                }
+                if (gdImageBoundsSafe(im_in, (int) Rint(xq), (int) Rint(yq))) {
+                    incol = gdImageGetPixel(im_in, (int) Rint(xq), (int) Rint(yq));
+                    red += gdImageRed(im_in, incol);
+                    green += gdImageGreen(im_in, incol);
+                    blue += gdImageBlue(im_in, incol);
+                    count++;
+                }
+            }
+
+            /* the original drew the background color as transparent too
+             */
+            want = -1;
+            if (count > 0) {
+                want = (red / count) << 16 | (green / count) << 8 | blue / count;
+                if (want == (color ? 0x000000 : 0xffffff)) {
+                    want = -1;
+                }
+            }
+            got = -1;
+            xs = xp - side / 2 - sprite->off_x;
+            ys = yp - side / 2 - sprite->off_y;
+            if (xs >= 0 && xs < sprite->mask->w && ys >= 0 && ys < sprite->mask->h) {
+                incol = gdImageGetPixel(sprite->image, xs, ys);
+                if (incol != gdImageGetTransparent(sprite->image)) {
+                    got = gdImageRed(sprite->image, incol) << 16 | 
+                          gdImageGreen(sprite->image, incol) << 8 | 
+                          gdImageBlue(sprite->image, incol);
+                }
+            }
+            if (want == got) {
+                continue;
+            }
+            if (tie) {
+                (*ties)++;
+            }else{
+                differ++;
+            }
+        }
+    }
+    return differ;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Get the area of overlap between game object and area defined by position and 
+height and width
+
+Return:
+ overlap area
+
+*/
+int overlap(GameObject game_object, int x, int y, int w, int h)
+{
+    int min_x,
+        min_y,
+        max_x,
+        max_y;
+
+    min_x = MAX(game_object.cen_x - game_object.radius, x);
+    min_y = MAX(game_object.cen_y - game_object.radius, y);
+    max_x = MIN(game_object.cen_x + game_object.radius, x + w);
+    max_y = MIN(game_object.cen_y + game_object.radius, y + h);
+
+    if ((min_x >= max_x) || (min_y >= max_y)) {
+        return 0;
+    } else {
+        return (max_x - min_x) * (max_y - min_y);
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Draw a circle in specified color around game_object
+
+*/
+void circleGameObject(gdImagePtr image, GameObject game_object, int color)
+{
+    gdImageArc(image, game_object.cen_x, game_object.cen_y, 
+               2 * game_object.radius, 2 * game_object.radius,
+               0, 360, color);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Read command arguments
+
+*/
+void getArgs(int argc, char* argv[])
+{
+    int c=0;
+
+    while (--argc > 0 && (*++argv)[0] == '-') { /* walks args */
+        if (strncmp(argv[0], "--", 2) == 0) {        /* long options */
+            if (strcmp(argv[0], "--label-budget-ms") == 0) {
+                label_budget = MAX(atoi((argv + 1)[0]), 1);
+                argv++;
+                argc--;
+            }else if (strcmp(argv[0], "--layout") == 0) {
+                layout_filename = strdup((++argv)[0]);
+                argc--;
+            }else if (strcmp(argv[0], "--check-spin") == 0) {
+                check_spin = 1;
+            }else if (strcmp(argv[0], "--sprite-cache") == 0) {
+                sprite_cache_dir = strdup((++argv)[0]);
+                argc--;
+            }else if (strcmp(argv[0], "--angle-bucket") == 0) {
+                num_buckets = MAX((int) (0.5 + 360.0 / 
+                                         MAX(atof((argv + 1)[0]), 1.0)), 1);
+                argv++;
+                argc--;
+            }else{
+                fprintf(stderr,"ftmap: illegal option %s\n",argv[0]);
+                argc=0;
+            }
+            continue;
+        }
+        while ( (c = *++argv[0]) ) {                /* walks arg string */
+            switch (toupper(c)) {
+                case 'A': {
+                    resample = 1;
+                    break;
+                }               
+                case 'B': {
+                    color = 0;
+                    break;
+                }               
+                case 'D': {
+                    debug = 1;
+                    break;
+                }	
+                case 'F': {
+                    gif_filename = strdup((++argv)[0]);
+                    argc--;
+                    break;
+                }
+				case 'G': {
+                    grid = 1;
+                    break;
+                }
+                case 'I': {
+                    image_dir = strdup((++argv)[0]);
+                    argc--;
+                    break;
+                }
+                case 'J': {
+                    num_threads = atoi((++argv)[0]);
+                    argc--;
+                    if (num_threads < 1) {
+                        num_threads = 1;
+                    }
+                    break;
+                }
+                case 'K': {
+                    bound_search = 1;
+                    good_overlap = atoi((++argv)[0]);
+                    argc--;
+                    break;
+                }
+                case 'L': {
+                    legend = 1;
+                    break;
+                }
+                case 'P': {
+                    pack_filename = strdup((++argv)[0]);
+                    argc--;
+                    break;
+                }
+				case 'R': {
+                    resource_filename = strdup((++argv)[0]);
+					argc--;
+                    break;
+                }
+                case 'S': {
+                    summed_area = 1;
+                    break;
+                }
+                case 'T': {
+                    real_thrust = 1;
+                    break;
+                }
+                case 'V': {
+                    verbose = 1;
+                    break;
+                }
+                case 'W': {
+                    wallpaper = 1;
+                    break;
+                }
+                default: {
+                    fprintf(stderr,"ftmap: illegal option %c\n",c);
+                    argc=0;
+                    break;
+                }
+            }
+            break;
+        }
+    }
+    if (argc) {
+        fprintf(stderr,"usage: ftmap -a -b -d "
+                "-f filename.gif -g -i image_dir -j threads -k overlap -l -p pack -r resource.ini -s -t -v -w\n"
+                "       --label-budget-ms ms --layout layout_file --check-spin\n"
+                "       --sprite-cache cache_dir --angle-bucket degrees\n");
+        exit(1);
+    }
+}
+
+
+
+/*
+------------------------------------------------------------------------------
+Draw map reference system, this is a pair of cartesan axes always along the
+bottom x & y axis of the image
+
+*/
+void drawMapAxes(gdImagePtr im, int axes_text_color, int axes_color,
+                 double pix_per_unit, int min_x, int min_y)
+{
+    int a=0;
+	int len=0;
+    int max_len = 0;
+    char text[10];
+
+	gdImageSetStyle(im,lgrid,lgrid_size);
+
+    /* Y-Axis Line
+     */
+    gdImageLine(im, 0, 0, 0, im->sy - 1,axes_color);
+
+    /* X-Axis Line 
+     */
+    gdImageLine(im,0,im->sy-1,im->sx-1,im->sy-1,axes_color);
+
+    /* Mark up X-Axis 
+     */
+    for (a = Rint(min_x);
+         Rint((double)(a - min_x)* pix_per_unit) < im->sx-1; a++) {
+        int x1;
+
+        x1 = Rint((double)(a - min_x) * pix_per_unit);
+        switch (abs (a % 10)) {
+
+            case 0:
+               len = sprintf(text, "%d", a);
+               if (x1 == 0) {
+                  ;
+               }else{ 
+                   gdImageLine(im,x1,im->sy-1,x1,im->sy-11,axes_color);
+                   gdImageString(im,gdFontSmall,
+                                 x1 - (len / 2) * ((gdFont *) gdFontSmall)->w,
+                                 im->sy - 11 - ((gdFont *) gdFontSmall)->h,
+                                 text, axes_text_color);
+               }
+			   /* draw optional grid 
+				*/
+               if (grid) {
+				  gdImageLine(im,x1,
+							  im->sy - 11 - ((gdFont *) gdFontSmall)->h,
+							  x1,0,gdStyled); 
+				  BoxMgr_addSegment
+					  (Segment_create
+					   (x1,im->sy - 11 - ((gdFont *) gdFontSmall)->h,x1,0,
+						LINE_DILATION));
+			  } 
+			   break;
+            
+            case 5:
+            gdImageLine(im,x1,im->sy-1,x1,im->sy-6,axes_color);
+            break;
+            
+            default:
+            gdImageLine(im,x1,im->sy-1,x1,im->sy-3,axes_color);
+            break;
+        }
+    }
+    /* Add clash box for X axis for height of text on axis (bottom) and for 
+	 * edge of map (top)
+     *
+     *
+     *           +----------------------+
+     *      top  |                      | 
+     *           +-y-+--------------+---+ 
+     *           | | |              |   |
+     *     left  | | |              |   | right
+     *           | | |              |   |
+     *           | | |              |   |
+	 *           +-|-+--------------+---+ 
+     *           | -----------------x   | bottom
+     *           +----------------------+
+     *
+	 *
+	 * top then bottom 
+	 */
+    BoxMgr_add(Box_boxInt(-EDGE_DILATION,0,im->sx+EDGE_DILATION,
+						  -EDGE_DILATION));
+    BoxMgr_add(Box_boxInt(-EDGE_DILATION,im->sy+EDGE_DILATION,
+						  im->sx+EDGE_DILATION,
+                          im->sy - 11 - ((gdFont *)gdFontSmall)->h));
+
+    /* Mark up Y-Axis get the widest annotation width 
+     */
+    for (a = Rint(min_y); 
+         Rint((double)(a - min_y) * pix_per_unit) < im->sy-1; a++) {
+        int y1;
+
+        y1 = Rint((double)im->sy - (double)(a - min_y)* pix_per_unit);
+        switch (abs (a % 10)) {
+
+            case 0:
+            len = sprintf(text, "%d", a);
+
+			/* save widest text width 
+			 */
+			if (len > max_len) {
+				max_len = len;
+			}
+
+            /* special don't annotate where the axes cross
+             */
+            if ( y1 == im->sy  ) {
+                ;
+            }else{
+            
+                gdImageLine(im,0,y1,10,y1,axes_color);
+                gdImageString(im,gdFontSmall,10+((gdFont *) gdFontSmall)->w,
+                              y1 - ((gdFont *) gdFontSmall)->h / 2,
+                              text,axes_text_color);
+            }
+
+			/* draw optional grid 
+			 */
+			if (grid) {
+			   gdImageLine(im,
+						   10 + (((gdFont*)gdFontSmall)->w * (len+1)) 
+						   ,y1,im->sx,y1,gdStyled);
+			   BoxMgr_addSegment
+				   (Segment_create
+					(10 + (((gdFont*)gdFontSmall)->w * (len+1)), y1, im->sx, y1,
+					 LINE_DILATION));
+		   }
+            break;
+            
+            case 5: 
+            gdImageLine(im,0,y1,5,y1,axes_color);
+            break;
+            
+            default:
+            gdImageLine(im,0,y1,2,y1,axes_color);
+            break;
+        }
+    }
+	/* Add clash box for Y axis for axis widest text on axis (left) and for 
+	 * edge of map (right) (see diagram above)
+	 *
+	 * left then right
+	 */
+    BoxMgr_add(Box_boxInt(-EDGE_DILATION,0,
+						  10 + (((gdFont *)gdFontSmall)->w * ++max_len),
+                          im->sy - 1));    
+    BoxMgr_add(Box_boxInt(im->sx,0,im->sx+EDGE_DILATION,im->sy - 1)); 
+}
+
+
+
+/*
+------------------------------------------------------------------------------
+Draw vector trail for game_objects course in Full or real thrust style
+
+In Full Thrust style the course is drawn along the game objects track using the
+delta heading value.
+
+In Real thrust style the course is drawn along the current heading at
+the current velocity showing where the game object will be if its course
+is not modified
+
+*/
+void plotCourse(gdImagePtr im, GameObject game_object, int color)
+{
+    double m2;
+    double m1;
+    double rad_heading;
+
+    double mid_x,
+           mid_y,
+           start_x,
+           start_y,
+           end_x,
+           end_y;
+    int h1,
+        h2;
+    int pix_mid_x,
+        pix_mid_y,
+        pix_start_x,
+        pix_start_y,
+        pix_end_x,
+        pix_end_y;
+
+    int mid_turn;
+
+    /* Set tracking linestyle 
+     */
+    gdImageSetStyle(im,lcourse,lcourse_size);
+
+    if (real_thrust) {
+        /* Real Thrust course plot
+         */
+        rad_heading = (game_object.heading / 180.0) * M_PI;
+        end_x = game_object.x + (game_object.speed * sin(rad_heading));
+        end_y = game_object.y + (game_object.speed * cos(rad_heading));
+        pix_end_x = (int) Rint((end_x - min_x) * pix_per_unit);
+        pix_end_y = im->sy - 1 - (int) Rint((end_y - min_y) * pix_per_unit);;
+
+        /* Draw line. Add course to the text box manager as a thick segment so
+         * angled lines only take up the map white space they cross
+         */
+        gdImageLine(im, game_object.cen_x, game_object.cen_y, pix_end_x, pix_end_y,
+                    gdStyled);
+        BoxMgr_addSegment(Segment_create(game_object.cen_x, game_object.cen_y, 
+                                         pix_end_x, pix_end_y, LINE_DILATION));
+    }
+    else {
+        /* Full Thrust course plot
+         */
+        mid_turn = game_object.delta_heading - 
+            (int) ((double) game_object.delta_heading / 2.0);
+        h2 = game_object.heading % 12;
+        h1 = (game_object.heading - mid_turn) % 12;
+        m2 = game_object.speed / 2.0;
+        m1 = m2; 
+ 
+        mid_x = game_object.x - (m2 * sin(M_PI * (double) h2 / 6.0));
+        mid_y = game_object.y - (m2 * cos(M_PI * (double) h2 / 6.0));
+        start_x = mid_x - (m1 * sin(M_PI * (double) h1 / 6.0));
+        start_y = mid_y - (m1 * cos(M_PI * (double) h1 / 6.0));
+
+        pix_mid_x = (int) Rint((mid_x - min_x) * pix_per_unit);
+        pix_mid_y = im->sy - 1 - (int) Rint((mid_y - min_y) * pix_per_unit);
+        pix_start_x = (int) Rint((start_x - min_x) * pix_per_unit);
+        pix_start_y = im->sy - 1 - (int) Rint((start_y - min_y) * pix_per_unit);
+
+        /* Draw both legs. Add each to the text box manager as a thick 
+         * segment so angled legs only take up the map white space they cross
+         */
+        gdImageLine(im, game_object.cen_x, game_object.cen_y, pix_mid_x, pix_mid_y,
+                    gdStyled);
+        BoxMgr_addSegment(Segment_create(game_object.cen_x, game_object.cen_y,
+                                         pix_mid_x, pix_mid_y, LINE_DILATION));
+        gdImageLine(im, pix_mid_x, pix_mid_y, pix_start_x, pix_start_y, gdStyled);
+        BoxMgr_addSegment(Segment_create(pix_mid_x, pix_mid_y, pix_start_x,
+                                         pix_start_y, LINE_DILATION));
+    }
+}
+
+
+
+/*
+------------------------------------------------------------------------------
+Copy an image into the map image
+
+*/
+void copyBackgroundImage(gdImagePtr map, int x, int y, int w, int h, gdImagePtr back)
+{
+    double aspect_ratio;
+    int src_w,
+        src_h,
+        dy,
+        dx;
+    if (debug) {
+        printf("Background transparency %d\n",gdImageGetTransparent(back));
+    }
+    /* Turn off any transparency or you'll get nasty holes in the background image
+     */
+    gdImageColorTransparent(back,-1);
+    if (back == NULL) {
+        return;
+    }
+    /* Wallpaper or stretch the background image
+     */
+    if (wallpaper) {
+        /* Wallpaper tiled
+         */
+        src_w = (int) 1.0 + (w / gdImageSX(back));
+        src_h = (int) 1.0 + (h / gdImageSY(back));
+        for (dy = 0; (dy < src_h); dy++) {
+            for (dx = 0; (dx < src_w); dx++) {
+                gdImageCopy(map, back, dx * back->sx, dy * back->sy, 0, 0, back->sx, back->sy);
+             }
+        }
+    }else{ 
+        /* Stretch to fit 
+         */
+        aspect_ratio = (double) w / (double) h;
+        src_w = Rint(aspect_ratio * (back->sy));
+        src_h = Rint((back->sx) / aspect_ratio);
+
+        if (src_w > (back->sx)) {
+            src_w = back->sx;
+        } else if (src_h > (back->sy)) {
+            src_h = back->sy;
+        }
+        gdImageCopyResized(map, back, x, y, 0, 0, w, h, src_w, src_h);
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Blend pixel to percentage of target rgb values
+
+*/
+void mergePixelColor(gdImagePtr im, int x, int y,
+                             int r, int g, int b,
+                             int pct_original)
+{
+    int in_color,
+        out_color;
+    int out_r,
+        out_g,
+        out_b;
+
+    in_color = gdImageGetPixel(im, x, y);
+
+    out_r = (gdImageRed(im, in_color) * pct_original
+             + r * (100 - pct_original)) / 100;
+
+    out_g = (gdImageGreen(im, in_color) * pct_original
+             + g * (100 - pct_original)) / 100;
+
+    out_b = (gdImageBlue(im, in_color) * pct_original
+             + b * (100 - pct_original)) / 100;
+
+    out_color = gdImageColorExact(im, out_r, out_g, out_b);
+    if (out_color == -1) {
+        out_color = gdImageColorAllocate(im, out_r, out_g, out_b);
+        if (out_color == -1) {
+            out_color = gdImageColorClosest(im, out_r, out_g, out_b);
+        }
+    }
+    gdImageSetPixel(im, x, y, out_color);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Fade out pixels under box
+
+*/
+void fadeBox(gdImagePtr im, Box box, int pct_fade)
+{
+    int x,
+        y;
+
+    for (x = box.min_x; x <= box.max_x; x++) {
+        for (y = box.min_y; y <= box.max_y; y++) {
+            mergePixelColor(im, x, y, 0, 0, 0, (100 - pct_fade));
+        }
+    }
+}
+
+
+/* 
+------------------------------------------------------------------------------
+Make string upper case, modifies the contents but not the base pointer
+
+*/
+void strupper(char *s1) 
+{
+	char *s2;
+
+	s2 = s1;
+	while (*s2) {
+		*s2 = toupper(*s2);
+		s2++;
+	}
+}
+
+/* 
+------------------------------------------------------------------------------
+Process Color section in resource file 
+
+if allocate then allocate the colors in the out image palette
+ 
+*/
+void colorSection(FILE *r_file, int allocate) 
+{
+	char line[256];
+	while (fgets(line, 255, r_file)) {
+		char* s;
+		char* d;
+
+		/* strip comments from line 
+		 */		  
+		strupper(line);
+		s = strstr(line,";");
+		if (s) {
+			*s = '\0';
+		}
+		
+		/* end of section - pop the line back and continue section processing
+		 */
+		if (strstr(line,"[")) {
+			fputs(line,r_file);
+			return;
+		}
+		
+		/* extract expected values this is three integers for r g b after an 
+         * '=' character 
+		 */
+		if (strlen(line) > 0 ) {
+			d = strstr(line,"=");
+			if (d) {
+				int r,g,b;
+				sscanf(++d,"%d%d%d",&r,&g,&b);
+
+				if (strstr(line,"BACKGROUNDCOLOR")) {
+					if ( allocate ) background_color = gdImageColorAllocate(im_out, r, g, b);
+				}
+				if (strstr(line,"FOREGROUNDCOLOR")) {
+					if ( allocate ) foreground_color = gdImageColorAllocate(im_out, r, g, b);
+					foreground_rgb.r = r;
+					foreground_rgb.g = g;
+					foreground_rgb.b = b;
+				}
+				if (strstr(line,"TITLETEXTCOLOR")) {
+					if ( allocate ) title_text_color = gdImageColorAllocate(im_out, r, g, b);
+				}
+				if (strstr(line,"LABELTEXTCOLOR")) {
+					if ( allocate ) label_text_color = gdImageColorAllocate(im_out, r, g, b);
+				}
+				if (strstr(line,"AXESCOLOR")) {
+					if ( allocate ) axes_color =  gdImageColorAllocate(im_out, r, g, b);
+				}
+				if (strstr(line,"AXESTEXTCOLOR")) {
+					if ( allocate ) axes_text_color = gdImageColorAllocate(im_out, r, g, b);
+				}
+				if (strstr(line,"LEGENDCOLOR")) {
+					if ( allocate ) legend_color = gdImageColorAllocate(im_out, r, g, b);
+				}
+				if (strstr(line,"LEGENDTEXTCOLOR")) {
+					if ( allocate ) legend_text_color = gdImageColorAllocate(im_out, r, g, b);
+				}
+				if (strstr(line,"LEADERCOLOR")) {
+					if ( allocate ) leader_color = gdImageColorAllocate(im_out, r, g, b);
+				}
+				if (strstr(line,"COURSECOLOR")) {
+					if ( allocate ) course_color = gdImageColorAllocate(im_out, r, g, b);
+				}
+				if (strstr(line,"GRIDCOLOR")) {
+					if ( allocate ) axes_grid_color = gdImageColorAllocate(im_out, r, g, b);
+				}
+				if (strstr(line,"LOCUSCOLOR")) {
+					if ( allocate ) locus_color = gdImageColorAllocate(im_out, r, g, b);
+				}
+			}else{
+				fprintf(stderr,"**** Warning bad resource file entry \n%s\n",line);
+			}
+		}
+	}
+}
+
+
+
+/* 
+------------------------------------------------------------------------------
+Read resource file information
+ 
+*/
+void readResource(int allocate) {
+	 char line[256];
+	 FILE * r_file;
+
+	 if (verbose) printf("Reading resource file %s\n",resource_filename);
+	 r_file = fopen(resource_filename, "r");
+
+	 /* read line until EOL || EOF
+	  */
+     while (fgets(line, 255, r_file)) {
+		 char* s;
+
+		 /* strip comments from line 
+		  */
+		 strupper(line);
+         s = strstr(line,";");
+         if (s) {
+			 *s = '\0';
+		 }
+
+		 /* find section header 
+		  */
+		 if (strstr(line,"[")) {
+			 if (strstr(line,"]")) {
+
+				 /* process sections
+				  */
+				 if (strstr(line,"COLOR")) {
+					 colorSection(r_file, allocate);
+				 }
+			 }else{
+				 fprintf(stderr,"**** Error bad resource section %s\n",line);
+			 }
+		 }
+	 }
+	 fclose(r_file);
+}
+
+/*
+------------------------------------------------------------------------------
+FNV-1a hash of a block of bytes, continuing from hash
+
+*/
+uint64_t SpriteCache_hash(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *byte = (const unsigned char *) data;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= byte[i];
+        hash *= SPRITE_CACHE_PRIME;
+    }
+    return hash;
+}
+
+/*
+------------------------------------------------------------------------------
+Cache key of a class image, the gif file bytes and everything that changes 
+the sprites made from them
+
+*/
+uint64_t SpriteCache_key(FILE *gif_file, double scale)
+{
+    unsigned char buffer[MAX_BUFFER];
+    uint64_t hash = SPRITE_CACHE_BASIS;
+    int32_t settings[6];
+    size_t len;
+
+    while ((len = fread(buffer, 1, sizeof (buffer), gif_file)) > 0) {
+        hash = SpriteCache_hash(hash, buffer, len);
+    }
+    settings[0] = SPRITE_CACHE_VERSION;
+    settings[1] = resample;
+    settings[2] = color;
+    settings[3] = foreground_rgb.r;
+    settings[4] = foreground_rgb.g;
+    settings[5] = foreground_rgb.b;
+    hash = SpriteCache_hash(hash, settings, sizeof (settings));
+    return SpriteCache_hash(hash, &scale, sizeof (scale));
+}
+
+/*
+------------------------------------------------------------------------------
+Cache file name of a key
+
+*/
+void SpriteCache_path(char *path, uint64_t key)
+{
+    sprintf(path, "%s%s%016llx.spr", sprite_cache_dir, SLASH, 
+            (unsigned long long) key);
+}
+
+/*
+------------------------------------------------------------------------------
+Write an image to a cache file, size, palette with the open flags, 
+transparent color then the pixels a column at a time as gd holds them. The 
+file is native byte order, a cache only serves the machine that wrote it
+
+*/
+int SpriteCache_writeImage(FILE *cache_file, gdImagePtr im)
+{
+    unsigned char palette[gdMaxColors * 4];
+    int32_t header[4];
+    int i;
+    int x;
+
+    header[0] = im->sx;
+    header[1] = im->sy;
+    header[2] = im->colorsTotal;
+    header[3] = im->transparent;
+    for (i = 0; i < im->colorsTotal; i++) {
+        palette[i * 4] = im->red[i];
+        palette[i * 4 + 1] = im->green[i];
+        palette[i * 4 + 2] = im->blue[i];
+        palette[i * 4 + 3] = im->open[i];
+    }
+    if (fwrite(header, sizeof (header), 1, cache_file) != 1 ||
+        fwrite(palette, 4, im->colorsTotal, cache_file) != (size_t) im->colorsTotal) {
+        return FALSE;
+    }
+    for (x = 0; x < im->sx; x++) {
+        if (fwrite(im->pixels[x], 1, im->sy, cache_file) != (size_t) im->sy) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+------------------------------------------------------------------------------
+Read an image written by SpriteCache_writeImage, NULL if the file is short 
+or damaged
+
+*/
+gdImagePtr SpriteCache_readImage(FILE *cache_file)
+{
+    unsigned char palette[gdMaxColors * 4];
+    int32_t header[4];
+    gdImagePtr im;
+    int i;
+    int x;
+
+    if (fread(header, sizeof (header), 1, cache_file) != 1 ||
+        header[0] <= 0 || header[1] <= 0 || 
+        header[0] > SPRITE_CACHE_SIDE || header[1] > SPRITE_CACHE_SIDE ||
+        header[2] < 0 || header[2] > gdMaxColors ||
+        header[3] < -1 || header[3] >= header[2] ||
+        fread(palette, 4, header[2], cache_file) != (size_t) header[2]) {
+        return NULL;
+    }
+    im = gdImageCreate(header[0], header[1]);
+    im->colorsTotal = header[2];
+    for (i = 0; i < im->colorsTotal; i++) {
+        im->red[i] = palette[i * 4];
+        im->green[i] = palette[i * 4 + 1];
+        im->blue[i] = palette[i * 4 + 2];
+        im->open[i] = palette[i * 4 + 3];
+    }
+    im->transparent = header[3];
+    for (x = 0; x < im->sx; x++) {
+        if (fread(im->pixels[x], 1, im->sy, cache_file) != (size_t) im->sy) {
+            gdImageDestroy(im);
+            return NULL;
+        }
+    }
+    return im;
+}
+
+/*
+------------------------------------------------------------------------------
+Look a class up in the sprite cache. On a hit read the recolored class 
+image, which still feeds the color manager, and the headings in use, then 
+mask them. Returns the class image or NULL on a miss
+
+*/
+gdImagePtr SpriteCache_load(int class_num, uint64_t key)
+{
+    char path[MAX_BUFFER];
+    FILE *cache_file;
+    char magic[4];
+    int32_t version;
+    uint64_t file_key;
+    int32_t offset[12];
+    gdImagePtr source = NULL;
+    Sprite *sprite;
+    int heading;
+    int32_t trim[2];
+    int hit;
+
+    SpriteCache_path(path, key);
+    cache_file = fopen(path, "rb");
+    if (!cache_file) {
+        return NULL;
+    }
+    hit = fread(magic, sizeof (magic), 1, cache_file) == 1 &&
+          memcmp(magic, SPRITE_CACHE_MAGIC, sizeof (magic)) == 0 &&
+          fread(&version, sizeof (version), 1, cache_file) == 1 &&
+          version == SPRITE_CACHE_VERSION &&
+          fread(&file_key, sizeof (file_key), 1, cache_file) == 1 &&
+          file_key == key &&
+          fread(offset, sizeof (offset), 1, cache_file) == 1 &&
+          (source = SpriteCache_readImage(cache_file)) != NULL;
+    for (heading = 0; hit && heading < 12; heading++) {
+        sprite = class[class_num].sprite[heading];
+        if (sprite) {
+            hit = fseek(cache_file, offset[heading], SEEK_SET) == 0 &&
+                  fread(trim, sizeof (trim), 1, cache_file) == 1 &&
+                  (sprite->image = SpriteCache_readImage(cache_file)) != NULL;
+            sprite->off_x = trim[0];
+            sprite->off_y = trim[1];
+            sprite->foreground = NOT_DEFINED;
+        }
+    }
+    fclose(cache_file);
+
+    /* a damaged entry is a miss, drop what was read
+     */
+    for (heading = 0; heading < 12; heading++) {
+        sprite = class[class_num].sprite[heading];
+        if (sprite && sprite->image) {
+            if (hit) {
+                sprite->mask = Mask_create(sprite->image, gdImageSX(sprite->image),
+                                           gdImageSY(sprite->image));
+            }else{
+                gdImageDestroy(sprite->image);
+                sprite->image = NULL;
+            }
+        }
+    }
+    if (!hit && source) {
+        gdImageDestroy(source);
+        source = NULL;
+    }
+    return source;
+}
+
+/*
+------------------------------------------------------------------------------
+Store the recolored class image and all twelve headings of a class, each 
+trimmed image after its offsets from the game object centre, in the sprite 
+cache. Written under a temporary name and renamed so that a map 
+drawn at the same time never reads half an entry
+
+*/
+void SpriteCache_save(int class_num, uint64_t key, gdImagePtr source)
+{
+    char path[MAX_BUFFER];
+    char temp_path[MAX_BUFFER + 4];
+    FILE *cache_file;
+    int32_t version = SPRITE_CACHE_VERSION;
+    int32_t offset[12];
+    int32_t trim[2];
+    int heading;
+    int written;
+
+    memset(offset, 0, sizeof (offset));
+    SpriteCache_path(path, key);
+    sprintf(temp_path, "%s.tmp", path);
+    cache_file = fopen(temp_path, "wb");
+    if (!cache_file) {
+        fprintf(stderr,"**** Warning unable to write sprite cache %s\n", temp_path);
+        return;
+    }
+    written = fwrite(SPRITE_CACHE_MAGIC, 4, 1, cache_file) == 1 &&
+              fwrite(&version, sizeof (version), 1, cache_file) == 1 &&
+              fwrite(&key, sizeof (key), 1, cache_file) == 1 &&
+              fwrite(offset, sizeof (offset), 1, cache_file) == 1 &&
+              SpriteCache_writeImage(cache_file, source);
+    for (heading = 0; written && heading < 12; heading++) {
+        offset[heading] = (int32_t) ftell(cache_file);
+        trim[0] = class[class_num].sprite[heading]->off_x;
+        trim[1] = class[class_num].sprite[heading]->off_y;
+        written = fwrite(trim, sizeof (trim), 1, cache_file) == 1 &&
+                  SpriteCache_writeImage(cache_file, 
+                                         class[class_num].sprite[heading]->image);
+    }
+
+    /* fill in the heading offsets now they are known
+     */
+    written = written && 
+              fseek(cache_file, 16, SEEK_SET) == 0 &&
+              fwrite(offset, sizeof (offset), 1, cache_file) == 1;
+    written = fclose(cache_file) == 0 && written;
+    remove(path);
+    if (!written || rename(temp_path, path) != 0) {
+        fprintf(stderr,"**** Warning unable to write sprite cache %s\n", path);
+        remove(temp_path);
+    }
+}
+
+/*
+------------------------------------------------------------------------------
+Open a sprite pack made by ftmap-prep. The pack is mapped copy on write, 
+the sprites point into it and may still be recolored. Returns NULL if the 
+pack was made with other settings, the game object gifs are used instead
+
+*/
+Pack *Pack_open(char *filename)
+{
+    Pack *pack;
+    size_t num_classes;
+#ifdef WIN32
+    FILE *pack_file;
+    long size;
+
+    pack = (Pack *) calloc(1, sizeof (Pack));
+    pack_file = fopen(filename, "rb");
+    if (pack_file && fseek(pack_file, 0, SEEK_END) == 0 && 
+        (size = ftell(pack_file)) > 0) {
+        pack->size = size;
+        pack->data = (char *) malloc(pack->size);
+        rewind(pack_file);
+        if (fread(pack->data, 1, pack->size, pack_file) != pack->size) {
+            free(pack->data);
+            pack->data = NULL;
+        }
+    }
+    if (pack_file) {
+        fclose(pack_file);
+    }
+#else
+    struct stat status;
+    int fd;
+
+    pack = (Pack *) calloc(1, sizeof (Pack));
+    fd = open(filename, O_RDONLY);
+    if (fd != -1 && fstat(fd, &status) == 0 && status.st_size > 0) {
+        pack->size = status.st_size;
+        pack->data = (char *) mmap(NULL, pack->size, PROT_READ | PROT_WRITE, 
+                                   MAP_PRIVATE, fd, 0);
+        if (pack->data == MAP_FAILED) {
+            pack->data = NULL;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+#endif
+    if (pack->data == NULL) {
+        fprintf(stderr,"**** Error unable to read sprite pack %s\n**** Aborting\n",
+                filename);
+        exit(1);
+    }
+    pack->header = (PackHeader *) pack->data;
+    pack->class = (PackClass *) (pack->data + sizeof (PackHeader));
+    num_classes = pack->size < sizeof (PackHeader) ? 0 : 
+                  (pack->size - sizeof (PackHeader)) / sizeof (PackClass);
+    if (pack->size < sizeof (PackHeader) ||
+        memcmp(pack->header->magic, PACK_MAGIC, 4) != 0 ||
+        pack->header->version != PACK_VERSION ||
+        pack->header->num_classes < 0 ||
+        (size_t) pack->header->num_classes > num_classes) {
+        fprintf(stderr,"**** Error %s is damaged or not a sprite pack of this version\n**** Aborting\n",
+                filename);
+        exit(1);
+    }
+    if (pack->header->resample != resample || pack->header->color != color ||
+        pack->header->foreground[0] != foreground_rgb.r ||
+        pack->header->foreground[1] != foreground_rgb.g ||
+        pack->header->foreground[2] != foreground_rgb.b) {
+        fprintf(stderr,"**** Warning sprite pack %s made with other -a, -b or "
+                "foreground settings, not used\n", filename);
+        return NULL;
+    }
+    return pack;
+}
+
+/*
+------------------------------------------------------------------------------
+Find a class by name in the pack index, NULL if it isn't packed
+
+*/
+PackClass *Pack_findClass(Pack *pack, char *name)
+{
+    int low = 0,
+        high = pack->header->num_classes - 1;
+    int mid;
+    int order;
+    int32_t offset;
+
+    while (low <= high) {
+        mid = (low + high) / 2;
+        offset = pack->class[mid].name;
+        if (offset < 0 || (size_t) offset >= pack->size ||
+            memchr(pack->data + offset, '\0', pack->size - offset) == NULL) {
+            return NULL;
+        }
+        order = strcmp(name, pack->data + offset);
+        if (order == 0) {
+            return &pack->class[mid];
+        }
+        if (order < 0) {
+            high = mid - 1;
+        }else{
+            low = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+/*
+------------------------------------------------------------------------------
+Make a sprite from a packed image, the pixel columns and mask bits stay in 
+the pack. Returns FALSE if the image runs past the end of the pack
+
+*/
+int Pack_sprite(Pack *pack, int32_t offset, Sprite *sprite)
+{
+    PackImage *packed;
+    unsigned char *pixels;
+    size_t pixel_bytes;
+    size_t mask_bytes;
+    gdImagePtr im;
+    Mask *mask;
+    int i;
+    int x;
+
+    if (offset < 0 || offset % 8 != 0 || 
+        (size_t) offset + sizeof (PackImage) > pack->size) {
+        return FALSE;
+    }
+    packed = (PackImage *) (pack->data + offset);
+    if (packed->sx <= 0 || packed->sy <= 0 || 
+        packed->sx > SPRITE_CACHE_SIDE || packed->sy > SPRITE_CACHE_SIDE ||
+        packed->colors_total < 0 || packed->colors_total > gdMaxColors ||
+        packed->transparent < -1 || packed->transparent >= packed->colors_total ||
+        packed->mask_x < 0 || packed->mask_y < 0 || 
+        packed->mask_w < 0 || packed->mask_h < 0 ||
+        packed->mask_x + packed->mask_w > packed->sx ||
+        packed->mask_y + packed->mask_h > packed->sy ||
+        packed->mask_words != (packed->mask_w + 63) / 64) {
+        return FALSE;
+    }
+    pixel_bytes = PACK_ALIGN((size_t) packed->sx * packed->sy);
+    mask_bytes = ((size_t) packed->mask_words * packed->mask_h + 1) * sizeof (uint64_t);
+    if ((size_t) offset + sizeof (PackImage) + pixel_bytes + mask_bytes > pack->size) {
+        return FALSE;
+    }
+    pixels = (unsigned char *) (packed + 1);
+
+    im = (gdImagePtr) calloc(1, sizeof (gdImage));
+    im->pixels = (unsigned char **) malloc(sizeof (unsigned char *) * packed->sx);
+    for (x = 0; x < packed->sx; x++) {
+        im->pixels[x] = pixels + (size_t) x * packed->sy;
+    }
+    im->sx = packed->sx;
+    im->sy = packed->sy;
+    im->colorsTotal = packed->colors_total;
+    for (i = 0; i < im->colorsTotal; i++) {
+        im->red[i] = packed->palette[i][0];
+        im->green[i] = packed->palette[i][1];
+        im->blue[i] = packed->palette[i][2];
+        im->open[i] = packed->palette[i][3];
+    }
+    im->transparent = packed->transparent;
+
+    mask = (Mask *) malloc(sizeof (Mask));
+    mask->x = packed->mask_x;
+    mask->y = packed->mask_y;
+    mask->w = packed->mask_w;
+    mask->h = packed->mask_h;
+    mask->words = packed->mask_words;
+    mask->bits = (uint64_t *) (pixels + pixel_bytes);
+
+    sprite->image = im;
+    sprite->mask = mask;
+    sprite->off_x = packed->off_x;
+    sprite->off_y = packed->off_y;
+    sprite->foreground = NOT_DEFINED;
+    return TRUE;
+}
+
+/*
+------------------------------------------------------------------------------
+Find a class in the sprite pack at the same scale, NULL if it isn't packed
+
+*/
+PackClass *Pack_classEntry(Pack *pack, int class_num)
+{
+    PackClass *packed;
+
+    packed = Pack_findClass(pack, class[class_num].name);
+    if (packed == NULL || packed->scale != class_image[class_num].scale) {
+        return NULL;
+    }
+    if (packed->colors < 0 || packed->num_colors < 0 ||
+        packed->num_colors > gdMaxColors ||
+        (size_t) packed->colors + packed->num_colors * sizeof (ColorCount) > pack->size) {
+        return NULL;
+    }
+    return packed;
+}
+
+/*
+------------------------------------------------------------------------------
+Take a class from the sprite pack if it is there at the same scale. Its 
+counted colors go to the color manager and its headings in use become 
+sprites, so its gif is never read. Returns FALSE if the class isn't packed
+
+*/
+int Pack_loadClass(Pack *pack, int class_num)
+{
+    PackClass *packed;
+    int heading;
+
+    packed = Pack_classEntry(pack, class_num);
+    if (packed == NULL) {
+        return FALSE;
+    }
+    for (heading = 0; heading < 12; heading++) {
+        if (class[class_num].sprite[heading] &&
+            !Pack_sprite(pack, packed->heading[heading], class[class_num].sprite[heading])) {
+            fprintf(stderr,"**** Error sprite pack damaged at class %s\n**** Aborting\n",
+                    class[class_num].name);
+            exit(1);
+        }
+    }
+    class_image[class_num].colors = (ColorCount *) (pack->data + packed->colors);
+    class_image[class_num].num_colors = packed->num_colors;
+    ColorMgr_addColorCounts(class_image[class_num].colors, 
+                            class_image[class_num].num_colors, IMAGE_PALETTE_SIZE);
+    class[class_num].radius = packed->radius;
+    return TRUE;
+}
+
+#ifdef FTMAP_PREP
+/*
+------------------------------------------------------------------------------
+Pad a pack file being written to the next 8 byte boundary
+
+*/
+void Pack_pad(FILE *pack_file)
+{
+    static const char zero[8] = {0};
+
+    fwrite(zero, 1, PACK_ALIGN(ftell(pack_file)) - ftell(pack_file), pack_file);
+}
+
+/*
+------------------------------------------------------------------------------
+Write one sprite to a pack, its image header and palette, the pixels a 
+column at a time as gd holds them and then the mask bits
+
+*/
+int32_t Pack_writeSprite(FILE *pack_file, Sprite *sprite)
+{
+    PackImage packed;
+    gdImagePtr im = sprite->image;
+    int32_t offset;
+    int i;
+    int x;
+
+    memset(&packed, 0, sizeof (packed));
+    packed.sx = im->sx;
+    packed.sy = im->sy;
+    packed.colors_total = im->colorsTotal;
+    packed.transparent = im->transparent;
+    packed.mask_x = sprite->mask->x;
+    packed.mask_y = sprite->mask->y;
+    packed.mask_w = sprite->mask->w;
+    packed.mask_h = sprite->mask->h;
+    packed.mask_words = sprite->mask->words;
+    packed.off_x = sprite->off_x;
+    packed.off_y = sprite->off_y;
+    for (i = 0; i < im->colorsTotal; i++) {
+        packed.palette[i][0] = im->red[i];
+        packed.palette[i][1] = im->green[i];
+        packed.palette[i][2] = im->blue[i];
+        packed.palette[i][3] = im->open[i];
+    }
+    offset = (int32_t) ftell(pack_file);
+    fwrite(&packed, sizeof (packed), 1, pack_file);
+    for (x = 0; x < im->sx; x++) {
+        fwrite(im->pixels[x], 1, im->sy, pack_file);
+    }
+    Pack_pad(pack_file);
+    fwrite(sprite->mask->bits, sizeof (uint64_t), 
+           sprite->mask->words * sprite->mask->h + 1, pack_file);
+    return offset;
+}
+
+/*
+------------------------------------------------------------------------------
+Order classes by name for the pack index
+
+*/
+int Pack_compareClasses(const void *a, const void *b)
+{
+    return strcmp(class[*(const int *) a].name, class[*(const int *) b].name);
+}
+
+/*
+------------------------------------------------------------------------------
+Write every class with all its headings to a sprite pack. The header and 
+the class index sorted by name come first, then each class name, counted 
+colors and sprites, all on 8 byte boundaries so they can be used in place
+
+*/
+void Pack_write(char *filename)
+{
+    FILE *pack_file;
+    PackHeader header;
+    PackClass *packed;
+    PackClass *entry;
+    int order[MAX_CLASSES];
+    int class_num;
+    int same_as;
+    int heading;
+    int i;
+
+    pack_file = fopen(filename, "wb");
+    if (!pack_file) {
+        fprintf(stderr,"**** Error unable to write sprite pack %s\n**** Aborting\n",
+                filename);
+        exit(1);
+    }
+    memset(&header, 0, sizeof (header));
+    memcpy(header.magic, PACK_MAGIC, 4);
+    header.version = PACK_VERSION;
+    header.resample = resample;
+    header.color = color;
+    header.foreground[0] = foreground_rgb.r;
+    header.foreground[1] = foreground_rgb.g;
+    header.foreground[2] = foreground_rgb.b;
+    header.num_classes = num_classes;
+    fwrite(&header, sizeof (header), 1, pack_file);
+
+    for (i = 0; i < num_classes; i++) {
+        order[i] = i;
+    }
+    qsort(order, num_classes, sizeof (int), Pack_compareClasses);
+    packed = (PackClass *) calloc(num_classes + 1, sizeof (PackClass));
+    entry = (PackClass *) calloc(num_classes + 1, sizeof (PackClass));
+    fwrite(packed, sizeof (PackClass), num_classes, pack_file);
+
+    /* classes sharing sprites share their colors and images in the pack
+     */
+    for (class_num = 0; class_num < num_classes; class_num++) {
+        same_as = class_image[class_num].same_as;
+        if (same_as != -1) {
+            entry[class_num] = entry[same_as];
+        }else{
+            entry[class_num].colors = (int32_t) ftell(pack_file);
+            entry[class_num].num_colors = class_image[class_num].num_colors;
+            fwrite(class_image[class_num].colors, sizeof (ColorCount), 
+                   class_image[class_num].num_colors, pack_file);
+            Pack_pad(pack_file);
+            for (heading = 0; heading < 12; heading++) {
+                entry[class_num].heading[heading] = 
+                    Pack_writeSprite(pack_file, class[class_num].sprite[heading]);
+            }
+        }
+        entry[class_num].scale = class_image[class_num].scale;
+        entry[class_num].radius = class[class_num].radius;
+        entry[class_num].name = (int32_t) ftell(pack_file);
+        fwrite(class[class_num].name, 1, strlen(class[class_num].name) + 1, pack_file);
+        Pack_pad(pack_file);
+        if (verbose) printf("\tpacked %s\n", class[class_num].name);
+    }
+
+    /* fill in the class index by name now the offsets are known
+     */
+    for (i = 0; i < num_classes; i++) {
+        packed[i] = entry[order[i]];
+    }
+    if (ftell(pack_file) > INT32_MAX) {
+        fprintf(stderr,"**** Error sprite pack %s too large\n**** Aborting\n",
+                filename);
+        exit(1);
+    }
+    fseek(pack_file, sizeof (header), SEEK_SET);
+    fwrite(packed, sizeof (PackClass), num_classes, pack_file);
+    if (ferror(pack_file) | fclose(pack_file)) {
+        fprintf(stderr,"**** Error unable to write sprite pack %s\n**** Aborting\n",
+                filename);
+        exit(1);
+    }
+    free(packed);
+}
+#endif
+
+/*
+------------------------------------------------------------------------------
+Prepare the sprites in use for one of the first three headings of a class. 
+Resample the class image for the heading then turn it a quarter at a time 
+for the headings 3, 6 and 9 later, as far as the last one in use, and mask 
+and trim the ones in use. Jobs only read the class image so they can run on several 
+threads
+
+*/
+void prepareSprites(int job, void *arg)
+{
+    SpriteJobs *jobs = (SpriteJobs *) arg;
+    int class_num = job / 3;
+    int first = job % 3;
+    int last = -1;
+    int heading;
+    Sprite *sprite;
+    gdImagePtr image;
+    gdImagePtr turned;
+
+    if (jobs->cached[class_num] || class_image[class_num].same_as != -1) {
+        return;
+    }
+    for (heading = first; heading < 12; heading += 3) {
+        if (class[class_num].sprite[heading]) {
+            last = heading;
+        }
+    }
+    if (last == -1) {
+        return;
+    }
+
+    image = spinImage(jobs->level[class_num], &jobs->plane[class_num], 
+                      (M_PI / 6.0) * first, jobs->scale[class_num], 
+                      resample ? jobs->across[class_num] : 1);
+    if (check_spin) {
+        jobs->differ[job] = checkSpin(jobs->level[class_num], &jobs->plane[class_num],
+                                      (M_PI / 6.0) * first, jobs->scale[class_num],
+                                      jobs->across[class_num], &jobs->probes[job], 
+                                      &jobs->ties[job], &jobs->kernel[job]);
+    }
+    for (heading = first; ; heading += 3) {
+        sprite = class[class_num].sprite[heading];
+        turned = heading == last ? NULL : turnImage(image);
+        if (sprite) {
+
+            /* mask the drawn area for clash detection and trim to it
+             */
+            Sprite_trim(sprite, image);
+        }else{
+            gdImageDestroy(image);
+        }
+        if (turned == NULL) {
+            break;
+        }
+        image = turned;
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Prepare the sprite of a Real Thrust facing off the clock headings, resampled
+straight from the class image at the bucket angle
+
+*/
+void prepareFacing(int job, void *arg)
+{
+    SpriteJobs *jobs = (SpriteJobs *) arg;
+    int class_num = jobs->bucket[job] / num_buckets;
+    int bucket = jobs->bucket[job] % num_buckets;
+
+    Sprite_trim(class_image[class_num].bucket[bucket], 
+                spinImage(jobs->level[class_num], &jobs->plane[class_num], 
+                          (2.0 * M_PI / num_buckets) * bucket, jobs->scale[class_num],
+                          resample ? jobs->across[class_num] : 1));
+}
+
+
+/*
+------------------------------------------------------------------------------
+Set the recolored image a class is spun from. At half its scale or less the 
+image is halved to the mip pyramid level nearest the scale, never below it,
+and the level is spun at the remaining scale. A level pixel is already the 
+mean of the input pixels it covers so it is resampled with fewer probes. 
+The level and color plane are only built where sprites are still to be 
+made, a cached class only needs the level size for its radius
+
+*/
+void spinSource(SpriteJobs *jobs, int class_num, gdImagePtr image)
+{
+    gdImagePtr half;
+    int build;
+    int sx = image->sx,
+        sy = image->sy;
+
+    build = !jobs->cached[class_num] || class_image[class_num].bucket;
+    jobs->source[class_num] = image;
+    jobs->level[class_num] = image;
+    jobs->scale[class_num] = class_image[class_num].scale;
+    jobs->across[class_num] = SPIN_PROBES;
+    while (jobs->scale[class_num] <= SPIN_MIP_SCALE && sx > 1 && sy > 1) {
+        if (build) {
+            half = halveImage(jobs->level[class_num]);
+            if (jobs->level[class_num] != image) {
+                gdImageDestroy(jobs->level[class_num]);
+            }
+            jobs->level[class_num] = half;
+        }
+        sx = (sx + 1) / 2;
+        sy = (sy + 1) / 2;
+        jobs->scale[class_num] *= 2.0;
+        jobs->across[class_num] = SPIN_MIP_PROBES;
+    }
+    if (build) {
+        SpinPlane_init(&jobs->plane[class_num], jobs->level[class_num], 
+                       jobs->scale[class_num]);
+    }
+    class[class_num].radius = Spin_size(sx, sy, jobs->scale[class_num]) / 2;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Count the colors of a recolored class image, which a sprite pack keeps, and 
+add them to the color manager
+
+*/
+void classColors(int class_num, gdImagePtr image)
+{
+    ColorCount counts[gdMaxColors];
+
+    class_image[class_num].num_colors = ColorMgr_countImageColors(image, counts);
+    class_image[class_num].colors = (ColorCount *) 
+        malloc(class_image[class_num].num_colors * sizeof (ColorCount));
+    memcpy(class_image[class_num].colors, counts, 
+           class_image[class_num].num_colors * sizeof (ColorCount));
+    ColorMgr_addColorCounts(class_image[class_num].colors, 
+                            class_image[class_num].num_colors, IMAGE_PALETTE_SIZE);
+}
+
+/*
+------------------------------------------------------------------------------
+Mark a class heading as in use, its sprite is made by prepareGameImages
+
+*/
+void useSprite(int class_num, int heading)
+{
+    if (class[class_num].sprite[heading] == NULL) {
+        class[class_num].sprite[heading] = (Sprite *) calloc(1, sizeof (Sprite));
+    }
+    class_image[class_num].used = TRUE;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Mark a class Real Thrust facing bucket off the clock headings as in use, its 
+sprite is made by prepareGameImages
+
+*/
+Sprite *useBucket(int class_num, int bucket)
+{
+    if (class_image[class_num].bucket == NULL) {
+        class_image[class_num].bucket = (Sprite **) calloc(num_buckets, sizeof (Sprite *));
+    }
+    if (class_image[class_num].bucket[bucket] == NULL) {
+        class_image[class_num].bucket[bucket] = (Sprite *) calloc(1, sizeof (Sprite));
+    }
+    class_image[class_num].used = TRUE;
+    return class_image[class_num].bucket[bucket];
+}
+
+
+/*
+------------------------------------------------------------------------------
+Mark the sprite a game object faces as in use and get it. Real Thrust facings
+are degrees clockwise and are rounded to the nearest angle bucket, a bucket 
+on a clock heading is that heading's sprite and the others have their own, 
+made once for every game object of the class facing it
+
+*/
+Sprite *useFacing(int class_num, int facing)
+{
+    int bucket;
+
+    if (!real_thrust) {
+        useSprite(class_num, facing % 12);
+        return class[class_num].sprite[facing % 12];
+    }
+    bucket = (int) floor(facing * num_buckets / 360.0 + 0.5) % num_buckets;
+    if (bucket < 0) {
+        bucket += num_buckets;
+    }
+    if (bucket * 12 % num_buckets == 0) {
+        useSprite(class_num, bucket * 12 / num_buckets);
+        return class[class_num].sprite[bucket * 12 / num_buckets];
+    }
+    return useBucket(class_num, bucket);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Load game object classes, the images are only read once it is known which 
+classes are in use
+
+*/
+void loadGameImages ()
+{
+    char temp_name[MAX_BUFFER - 1];
+	
+	/* the gif foreground is white unless the resource file changes it */
+	foreground_rgb.r = 255;
+    foreground_rgb.g = 255;
+    foreground_rgb.b = 255;
+	
+	if (resource_filename && color) {
+		readResource(0);
+	}
+	if (verbose) printf("Foreground color is %d %d %d\n", foreground_rgb.r,foreground_rgb.g, foreground_rgb.b);
+
+    num_classes = 0;
+    if (verbose) printf("Reading game object classes\n");
+    do {
+        char game_object_filename[MAX_BUFFER];
+        int temp_x=0;
+
+        scanf("%s\n",temp_name);
+        if (temp_name[0] != '*') {
+            class[num_classes].name = (char *) strdup(temp_name);
+            scanf("%s\n", temp_name);
+            if (image_dir) {
+                sprintf(game_object_filename,"%s%s%s",image_dir,SLASH,
+                        temp_name);
+            } else {
+                strcpy(game_object_filename,temp_name);
+            }
+            class_image[num_classes].filename = strdup(game_object_filename);
+            scanf("%lf\n", &class_image[num_classes].scale);
+
+            scanf("%d\n", &temp_x);
+            if (temp_x) {
+                index_class[num_indexed_classes] = num_classes;
+                num_indexed_classes++;
+            }
+            num_classes++;
+        }
+    } while (temp_name[0] != '*');
+}
+
+
+/*
+------------------------------------------------------------------------------
+Compare two files byte for byte
+
+Return:
+ true  - same contents
+ false - different or unreadable
+
+*/
+int sameFile(char *filename1, char *filename2)
+{
+    FILE *file1;
+    FILE *file2;
+    char buffer1[MAX_BUFFER];
+    char buffer2[MAX_BUFFER];
+    size_t n1,
+           n2;
+    int same;
+
+    if (strcmp(filename1, filename2) == 0) {
+        return TRUE;
+    }
+    file1 = fopen(filename1, "rb");
+    file2 = fopen(filename2, "rb");
+    same = file1 != NULL && file2 != NULL;
+    while (same) {
+        n1 = fread(buffer1, 1, sizeof (buffer1), file1);
+        n2 = fread(buffer2, 1, sizeof (buffer2), file2);
+        same = n1 == n2 && memcmp(buffer1, buffer2, n1) == 0;
+        if (n1 == 0) {
+            break;
+        }
+    }
+    if (file1) {
+        fclose(file1);
+    }
+    if (file2) {
+        fclose(file2);
+    }
+    return same;
+}
+
+
+/*
+------------------------------------------------------------------------------
+Add the tints of the game objects to the color manager so the map palette 
+has their colors, the tint and a half shade of it for anti-aliased edges, 
+weighted by the area of the game objects drawn in it
+
+*/
+void tintColors()
+{
+    ColorCount counts[2 * MAX_TINTS];
+    int num_counts = 0;
+    int game_object_num;
+    int tint;
+    int area;
+    int c;
+
+    for (game_object_num = 0; game_object_num < num_game_objects; 
+         game_object_num++) {
+        tint = game_objects[game_object_num].tint;
+        if (tint == NO_TINT) {
+            continue;
+        }
+        area = game_objects[game_object_num].radius * 
+               game_objects[game_object_num].radius;
+        for (c = 0; c < num_counts; c += 2) {
+            if ((counts[c].r << 16 | counts[c].g << 8 | counts[c].b) == tint) {
+                break;
+            }
+        }
+        if (c == num_counts) {
+            if (num_counts == 2 * MAX_TINTS) {
+                continue;
+            }
+            counts[c].r = tint >> 16 & 0xff;
+            counts[c].g = tint >> 8 & 0xff;
+            counts[c].b = tint & 0xff;
+            counts[c + 1].r = counts[c].r / 2;
+            counts[c + 1].g = counts[c].g / 2;
+            counts[c + 1].b = counts[c].b / 2;
+            counts[c].unused = counts[c + 1].unused = 0;
+            counts[c].count = counts[c + 1].count = 0;
+            num_counts += 2;
+        }
+        counts[c].count += area;
+        counts[c + 1].count += area / 2;
+    }
+    ColorMgr_addColorCounts(counts, num_counts, IMAGE_PALETTE_SIZE);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Prepare the sprites of the classes in use, the headings the game objects 
+face and heading 3 for the legend
+
+*/
+void prepareGameImages ()
+{
+	FILE* out_file;
+    char temp_name[MAX_BUFFER - 1];
+    SpriteJobs *jobs;
+    gdImagePtr temp_image;
+    int hashed[MAX_CLASSES];
+    int class_num;
+    int other;
+    int heading;
+    int bucket;
+    int num_jobs;
+    int game_object_num;
+
+    if (check_spin) {
+        for (class_num = 0; class_num < num_classes; class_num++) {
+            for (heading = 0; heading < 12; heading++) {
+                useSprite(class_num, heading);
+            }
+        }
+    }
+    if (legend) {
+        for (class_num = 0; class_num < num_indexed_classes; class_num++) {
+            useSprite(index_class[class_num], 3);
+        }
+    }
+
+    /* Read the game object gifs in use. If creating a bitonal map make 
+     * negative images from the conventional, white on black. Add the image
+     * colors to the color manager in class order so that the main image 
+     * palette will be the best fit for the images used. The gif decoder isn't
+     * thread safe so this is done on one thread
+     */
+    jobs = (SpriteJobs *) calloc(1, sizeof (SpriteJobs));
+    Spin_chooseKernel();
+    if (pack_filename && !check_spin) {
+        sprite_pack = Pack_open(pack_filename);
+    }
+
+    /* Classes whose gifs have the same content at the same scale share the 
+     * sprites of the first of them, made at every heading any of them use.
+     * The key is the sprite cache key of the gif bytes, a match is only 
+     * taken once the gifs are found to have the same bytes
+     */
+    for (class_num = 0; class_num < num_classes; class_num++) {
+        hashed[class_num] = FALSE;
+        class_image[class_num].same_as = -1;
+        if (!class_image[class_num].used ||
+            (sprite_pack && class_image[class_num].bucket == NULL && 
+             Pack_classEntry(sprite_pack, class_num))) {
+            continue;
+        }
+        in_file = fopen(class_image[class_num].filename, "rb");
+        if (!in_file) {
+            fprintf(stderr,"**** Error unable to load source image %s\n**** Aborting\n",
+                    class_image[class_num].filename);
+            exit(0);
+        }
+        jobs->key[class_num] = SpriteCache_key(in_file, class_image[class_num].scale);
+        fclose(in_file);
+        hashed[class_num] = TRUE;
+        for (other = 0; other < class_num; other++) {
+            if (hashed[other] && class_image[other].same_as == -1 &&
+                jobs->key[other] == jobs->key[class_num] &&
+                class_image[other].scale == class_image[class_num].scale &&
+                sameFile(class_image[other].filename, 
+                         class_image[class_num].filename)) {
+                class_image[class_num].same_as = other;
+                for (heading = 0; heading < 12; heading++) {
+                    if (class[class_num].sprite[heading]) {
+                        useSprite(other, heading);
+                    }
+                }
+                for (bucket = 0; class_image[class_num].bucket && 
+                     bucket < num_buckets; bucket++) {
+                    if (class_image[class_num].bucket[bucket]) {
+                        useBucket(other, bucket);
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    if (verbose) printf("Reading game object images\n");
+    for (class_num = 0; class_num < num_classes; class_num++) {
+        if (!class_image[class_num].used) {
+            continue;
+        }
+
+        /* a class sharing sprites still adds its colors in its turn, they 
+         * are the colors of the class it shares with
+         */
+        other = class_image[class_num].same_as;
+        if (other != -1) {
+            if (verbose) printf("\t%s same as %s\n",class[class_num].name,
+                                class[other].name);
+            ColorMgr_addColorCounts(class_image[other].colors, 
+                                    class_image[other].num_colors, IMAGE_PALETTE_SIZE);
+            class_image[class_num].colors = class_image[other].colors;
+            class_image[class_num].num_colors = class_image[other].num_colors;
+            class[class_num].radius = class[other].radius;
+            continue;
+        }
+
+        /* a packed class has its colors counted and its headings ready, so 
+         * its gif is never opened. A pack has no class image to spin Real 
+         * Thrust facings from so those classes are read
+         */
+        if (sprite_pack && class_image[class_num].bucket == NULL && 
+            Pack_loadClass(sprite_pack, class_num)) {
+            if (verbose) printf("\t%s packed\n",class[class_num].name);
+            jobs->cached[class_num] = TRUE;
+            continue;
+        }
+        in_file = fopen(class_image[class_num].filename, "rb");
+        if (!in_file) {
+            fprintf(stderr,"**** Error unable to load source image %s\n**** Aborting\n",
+                    class_image[class_num].filename);
+            exit(0);
+        }
+
+        /* a cache hit has the recolored image and the headings ready, a 
+         * miss makes all twelve headings so that the entry serves any map
+         */
+        if (sprite_cache_dir && !check_spin) {
+            temp_image = SpriteCache_load(class_num, jobs->key[class_num]);
+            if (temp_image) {
+                fclose(in_file);
+                if (verbose) printf("\t%s cached\n",class_image[class_num].filename);
+                jobs->cached[class_num] = TRUE;
+                classColors(class_num, temp_image);
+                spinSource(jobs, class_num, temp_image);
+                continue;
+            }
+            for (heading = 0; heading < 12; heading++) {
+                useSprite(class_num, heading);
+            }
+        }
+        temp_image = gdImageCreateFromGif(in_file);
+        fclose(in_file);
+        if (verbose) printf("\t%s %s\n",class_image[class_num].filename,
+                            temp_image == NULL ?"not read":"read");
+
+        /* invert bitmap if bitonal 
+         */
+        int b,w,f; 
+        if (!color) {
+            b = Palette_color(temp_image,0,0,0);
+            w = Palette_color(temp_image,255,255,255);
+            Palette_recolor(temp_image,b,w,1);
+        }
+
+        /* if colors and the foreground isn't white swap it with white with the just loaded sprite */
+        if (color && !(foreground_rgb.r == 255 && foreground_rgb.g == 255 && foreground_rgb.b == 255 )) {
+            f = Palette_color(temp_image,foreground_rgb.r,foreground_rgb.g,foreground_rgb.b);
+            w = Palette_color(temp_image,255,255,255);
+            Palette_recolor(temp_image,f,w,1);
+        }
+
+        /* add image palette to color manager
+         */
+        classColors(class_num, temp_image);
+
+        spinSource(jobs, class_num, temp_image);
+    }
+
+    /* Pre-rotate to the headings in use, only the first three headings are 
+     * resampled, the rest are quarter turns of the heading three before
+     */
+    Jobs_run(num_classes * 3, prepareSprites, jobs);
+
+    /* Real Thrust facings off the clock headings are spun once per class 
+     * and bucket however many game objects face it
+     */
+    jobs->bucket = (int *) malloc(num_classes * num_buckets * sizeof (int));
+    num_jobs = 0;
+    for (class_num = 0; class_num < num_classes; class_num++) {
+        for (bucket = 0; class_image[class_num].bucket && 
+             class_image[class_num].same_as == -1 && bucket < num_buckets; bucket++) {
+            if (class_image[class_num].bucket[bucket]) {
+                jobs->bucket[num_jobs++] = class_num * num_buckets + bucket;
+            }
+        }
+    }
+    Jobs_run(num_jobs, prepareFacing, jobs);
+    free(jobs->bucket);
+
+    for (class_num = 0; class_num < num_classes; class_num++) {
+        /* a class sharing sprites points at the sprites of the class it 
+         * shares with, so recoloring and tint tables are made once for both
+         */
+        other = class_image[class_num].same_as;
+        for (heading = 0; other != -1 && heading < 12; heading++) {
+            if (class[class_num].sprite[heading]) {
+                free(class[class_num].sprite[heading]);
+                class[class_num].sprite[heading] = class[other].sprite[heading];
+            }
+        }
+        for (bucket = 0; other != -1 && class_image[class_num].bucket && 
+             bucket < num_buckets; bucket++) {
+            if (class_image[class_num].bucket[bucket]) {
+                free(class_image[class_num].bucket[bucket]);
+                class_image[class_num].bucket[bucket] = 
+                    class_image[other].bucket[bucket];
+            }
+        }
+        /* the finished headings against the original rotation, classes 
+         * spun from a mip level are drawn differently on purpose
+         */
+        for (heading = 0; check_spin && heading < 12 &&
+             jobs->level[class_num] == jobs->source[class_num]; heading++) {
+            spin_pixels += checkSprite(jobs->source[class_num], (M_PI / 6.0) * heading,
+                                       class_image[class_num].scale, 
+                                       resample ? SPIN_PROBES : 1,
+                                       class[class_num].sprite[heading], 
+                                       &spin_tie_pixels);
+        }
+        if (jobs->source[class_num]) {
+            if (sprite_cache_dir && !check_spin && !jobs->cached[class_num]) {
+                SpriteCache_save(class_num, jobs->key[class_num], 
+                                 jobs->source[class_num]);
+            }
+            if (jobs->level[class_num] != jobs->source[class_num]) {
+                gdImageDestroy(jobs->level[class_num]);
+            }
+            gdImageDestroy(jobs->source[class_num]);
+            free(jobs->plane[class_num].pixel);
+        }
+        for (heading = 0; debug && heading < 12; heading++) {
+            if (class[class_num].sprite[heading]) {
+                sprintf(temp_name,"%s%d.gif",class[class_num].name, heading);
+                out_file = fopen(temp_name, "wb");
+                gdImageGif(class[class_num].sprite[heading]->image, out_file);
+                fclose(out_file);
+            }
+        }
+    }
+    for (class_num = 0; class_num < num_classes * 3; class_num++) {
+        spin_differ += jobs->differ[class_num];
+        spin_probes += jobs->probes[class_num];
+        spin_ties += jobs->ties[class_num];
+        spin_kernel_differ += jobs->kernel[class_num];
+    }
+    free(jobs);
+
+    /* game objects take the size of their class, and those of a class 
+     * sharing sprites face the shared sprite
+     */
+    for (game_object_num = 0; game_object_num < num_game_objects; 
+         game_object_num++) {
+        class_num = game_objects[game_object_num].class_num;
+        game_objects[game_object_num].radius = class[class_num].radius;
+        if (class_image[class_num].same_as != -1) {
+            game_objects[game_object_num].face = 
+                useFacing(class_num, game_objects[game_object_num].facing);
+        }
+    }
+    if (color) {
+        tintColors();
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Load game object data
+
+*/
+void loadGameObjects()
+{   
+    char temp_name[256];
+	float temp;
+    int have_line = FALSE;
+
+    /* Get game object data from data file 
+     */
+    num_game_objects = 0;
+    if (verbose) printf("reading game objects\n");
+    do {
+        GameObject this_game_object;
+        int class_num=0;
+        int r,g,b;
+        char extra;
+
+        if (!have_line) {
+            fgets(temp_name,80,stdin);
+            temp_name[strlen(temp_name)-1] = '\0';
+        }
+        have_line = FALSE;
+        if (temp_name[0] != '*') {
+            this_game_object.name = strdup(temp_name);
+
+            scanf("%s\n", temp_name);
+            this_game_object.class_num = -1;
+            for (class_num = 0; class_num < num_classes; class_num++) {
+                if (strcmp(class[class_num].name, temp_name) == 0) {
+                    this_game_object.class_num = class_num;
+                    break;
+                }
+            }
+            if (this_game_object.class_num == -1) {
+                fprintf(stderr,"**** Error game object %s has unknown class %s\n**** Aborting\n",
+                        this_game_object.name, temp_name);
+                exit(1);
+            }
+
+            scanf("%f\n", &temp);
+            this_game_object.x = (double)temp;
+            scanf("%f\n", &temp);
+            this_game_object.y = (double)temp;
+            this_game_object.cen_x = 
+                (int) (0.5 + (this_game_object.x - min_x) * pix_per_unit);
+            this_game_object.cen_y = 
+                out_y - (int)(0.5 + (this_game_object.y -min_y) * pix_per_unit);
+            scanf("%d\n", &(this_game_object.heading));
+            scanf("%d\n", &(this_game_object.facing));
+            scanf("%f\n", &temp);
+            this_game_object.speed = (double)temp;
+            scanf("%d\n", &(this_game_object.delta_heading));
+
+            /* An optional tint line, the word tint then red green and blue, 
+             * follows. Otherwise the line is the next game object name or 
+             * the end
+             */
+            this_game_object.tint = NO_TINT;
+            if (fgets(temp_name,80,stdin) == NULL) {
+                strcpy(temp_name,"*\n");
+            }
+            temp_name[strlen(temp_name)-1] = '\0';
+            if (strncmp(temp_name, "tint ", 5) == 0) {
+                if (sscanf(temp_name + 5, "%d %d %d %c", &r, &g, &b, &extra) != 3 ||
+                    r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255) {
+                    fprintf(stderr,"**** Error game object %s has a bad tint line: %s\n**** Aborting\n",
+                            this_game_object.name, temp_name);
+                    exit(1);
+                }
+                this_game_object.tint = r << 16 | g << 8 | b;
+            }else{
+                have_line = TRUE;
+            }
+
+            /* Only the sprite the game object faces is made for its class
+             */
+            this_game_object.face = useFacing(this_game_object.class_num,
+                                              this_game_object.facing);
+         
+            /* Store game object, its size is set once its class image has been
+             * read
+             */                 
+            game_objects[num_game_objects++] = this_game_object;
+        }
+    } while (temp_name[0] != '*');
+}
+
+
+/*
+------------------------------------------------------------------------------
+Change the foreground of the sprites in use to the map foreground color, 
+once for each class heading and facing however many game objects or the 
+legend draw it. Classes sharing sprites share their images so only the 
+class they share with is changed
+
+*/
+void recolorSprites()
+{
+    int class_num;
+    int heading;
+    int bucket;
+
+    if (!color || foreground_color == NOT_DEFINED) {
+        return;
+    }
+    for (class_num = 0; class_num < num_classes; class_num++) {
+        if (!class_image[class_num].used || class_image[class_num].same_as != -1) {
+            continue;
+        }
+        for (heading = 0; heading < 12; heading++) {
+            if (class[class_num].sprite[heading]) {
+                Sprite_foreground(class[class_num].sprite[heading]);
+            }
+        }
+        for (bucket = 0; class_image[class_num].bucket && bucket < num_buckets; 
+             bucket++) {
+            if (class_image[class_num].bucket[bucket]) {
+                Sprite_foreground(class_image[class_num].bucket[bucket]);
+            }
+        }
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Fade game object background in gif image
+
+*/
+void fadeGameObjects() 
+{
+    Sprite *sprite;
+    int game_object_num;
+
+    /* Fade Game Object background 
+     */
+    if (verbose) printf("fading background for game objects\n");
+    for (game_object_num = 0; game_object_num < num_game_objects; 
+         game_object_num++) {
+        GameObject this_game_object;
+		
+        this_game_object = game_objects[game_object_num];
+        sprite = this_game_object.face;
+
+        /* if a background image then fade out the background under the 
+         * image so it isn't swamped by the background do this before
+         * adding the images or they get faded too. Only the trimmed image
+         * rectangle is faded
+         */
+        if (sprite->mask->w > 0) {
+            fadeBox(im_out, 
+                    Box_boxInt(this_game_object.cen_x + sprite->off_x,
+                               this_game_object.cen_y + sprite->off_y,
+                               this_game_object.cen_x + sprite->off_x + 
+                               sprite->mask->w - 1,
+                               this_game_object.cen_y + sprite->off_y + 
+                               sprite->mask->h - 1),
+                    GAME_OBJECT_FADE);
+        }
+	}
+}	
+
+
+
+/*
+------------------------------------------------------------------------------
+Draw game objects in new gif image
+
+*/
+void drawGameObjects() 
+{    
+    Sprite *sprite;
+    int game_object_num;
+
+    /* Plot Game_Object Images 
+     */
+    if (verbose) printf("Drawing game objects\n");
+    for (game_object_num = 0; game_object_num < num_game_objects; 
+         game_object_num++) {
+        GameObject this_game_object;
+
+        this_game_object = game_objects[game_object_num];
+        sprite = this_game_object.face;
+
+        if (this_game_object.tint != NO_TINT && color) {
+            Sprite_drawTinted(im_out, sprite, this_game_object.cen_x, 
+                              this_game_object.cen_y, this_game_object.tint);
+        }else{
+            Sprite_draw(im_out, sprite, this_game_object.cen_x, 
+                        this_game_object.cen_y);
+        }
+
+        /* Plot game object course after image so ship locus is clear
+         * as course terminates there
+         */
+        if (tracking) {
+            plotCourse(im_out, this_game_object, course_color);
+        }        
+
+        /* Add the game object image pixels to text box manager
+         */
+        BoxMgr_addMask(sprite->mask, this_game_object.cen_x + sprite->off_x,
+                       this_game_object.cen_y + sprite->off_y);
+    }
+}
+
+
+/*
+------------------------------------------------------------------------------
+Read data file header information
+ 
+*/
+void readHeader() {
+    char temp_name[MAX_BUFFER - 1];
+    char background_filename[MAX_BUFFER];
+	float temp;
+
+    /* Get Map Title 
+     */
+    fgets(temp_name, 80, stdin);
+    title = strdup(temp_name);
+    if (!isprint(title[strlen(title) - 1])) {
+        title[strlen(title) - 1] = '\0';
+    }
+    
+
+    /* Get Background image (if any) and color 
+     */
+    scanf("%s\n", temp_name);
+    if (color) {
+        if (temp_name[0] != '-') {
+            if (image_dir) {
+                sprintf(background_filename,"%s%s%s",image_dir,SLASH,temp_name);
+            } else {
+                strcpy(background_filename,temp_name);
+            }
+            in_file = fopen(background_filename, "rb");
+            if (!in_file) {
+                fprintf(stderr, "**** Error unable to load background image %s\n",
+                        background_filename );
+                background = NULL;
+            } else {
+                /* Create background image and add its color map to the oct-tree
+                 */
+                background = gdImageCreateFromGif(in_file);
+                fclose(in_file);
+                ColorMgr_getImageColorMap(background, IMAGE_PALETTE_SIZE);
+            }
+        } else {
+            background = NULL;
+        }
+    }else{
+        background = NULL;
+    }
+    
+    /* Get tracking flag 
+     */
+    scanf("%d\n", &tracking);
+    tracking = tracking ? 1 : 0;
+    
+    /* Get Map Corner Co-Ords 
+     */
+    scanf("%f\n", &temp);
+	min_x = (double)temp;
+    scanf("%f\n", &temp);
+    min_y = (double)temp;
+    scanf("%f\n", &temp);
+    max_x  = (double)temp;
+    scanf("%f\n", &temp);
+    max_y = (double)temp;
+    
+
+    /* Get pixels/unit ratio 
+     */
+    scanf("%f\n", &temp);
+    pix_per_unit = (double)temp;
+    out_x = (int) (0.5 + pix_per_unit * (max_x - min_x));
+    out_y = (int) (0.5 + pix_per_unit * (max_y - min_y));
+
+    /* Announce parameters
+     */
+    if (verbose) {
+        printf("title                %s\n",title);
+        printf("map extent           %f.1/%f.1 %f.1/%f.1\n",min_x, min_y, max_x, max_y);
+        printf("image resolution     %d x %d\n", out_x, out_y);
+        printf("map                  %s\n",color       ? "color" : "bitonal" );
+        printf("background           %s\n",background  ? background_filename : "plain" );
+        if (background) {
+        printf("tiling               %s\n",wallpaper   ? "on" : "off" );
+        }
+        printf("resampling           %s\n",resample    ? "on" : "off" );    
+        printf("object tracks        %s\n",tracking    ? "on" : "off" );
+        if (tracking) {
+        printf("real thrust plotting %s\n",real_thrust ? "on" : "off" );
+        }
+        if (real_thrust) {
+        printf("facing angle bucket  %g degrees\n",360.0 / num_buckets );
+        }
+        printf("grid                 %s\n",grid        ? "on" : "off" );
+        printf("legend               %s\n",legend      ? "on" : "off" );
+        printf("threads              %d\n",num_threads );
+        printf("clash scoring        %s\n",summed_area ? "summed area" : "box list" );
+        printf("label search         %s\n",bound_search ? "branch and bound" : "radial" );
+        if (bound_search) {
+        printf("good label clash     %d\n",good_overlap );
+        }
+        if (label_budget) {
+        printf("label time budget    %d ms\n",label_budget );
+        }
+        if (layout_filename) {
+        printf("label layout         %s\n",layout_filename );
+        }
+        if (sprite_cache_dir) {
+        printf("sprite cache         %s\n",sprite_cache_dir );
+        }
+        if (pack_filename) {
+        printf("sprite pack          %s\n",pack_filename );
+        }
+        printf("\n");
+    }
+}
+
+
+/* setStyles()
+------------------------------------------------------------------------------
+Set up complex linestyles
+ 
+*/
+void setStyles()
+{
+    /* Linestyle definitions & default style set according to color/bitonal
+     */
+    lcourse[0] = course_color;      
+    lcourse[1] = gdTransparent;
+    lcourse[2] = gdTransparent;
+    lcourse[3] = gdTransparent;
+    lgrid[0] = axes_grid_color;           
+    lgrid[1] = color ? axes_grid_color : gdTransparent;
+    lleader[0] = leader_color;        
+    lleader[1] = leader_color;
+}
+
+
+/* AnnoRing_get()
 ------------------------------------------------------------------------------
-Blend pixel to percentage of target rgb values
+Get the annotation candidate positions for a game object radius and text size
+
+Use a radial approach with a 360d rotation leader line increasing in radius 
+from the game object radius to the maximum leader length. The text box hangs 
+off the end of the leader line away from the game object according to the 
+quadrant.
+
+                                                   
+                                    r              
+                               +----------+--------+ angle +d degrees
+                         centre           | text   |      |
+                                          +--------+      V
+
+At small radii many of the angle steps round to the same pixel, only the 
+first of each is kept as a repeat can never score better. The positions are 
+relative to the game object centre so one set serves every game object with 
+the same radius and text size, sets are built once and kept
 
 */
-void mergePixelColor(gdImagePtr im, int x, int y,
-                             int r, int g, int b,
-                             int pct_original)
+AnnoRing *AnnoRing_get(int radius, int text_width, int text_height)
 {
-    int in_color,
-        out_color;
-    int out_r,
-        out_g,
-        out_b;
+    /* cartographic preference upper right, upper left, lower right, lower 
+     * left, right, left, above, below as search angles
+     */
+    static int anchor_angle[ANNO_ANCHORS] = { 315, 225, 45, 135, 0, 180, 270, 90 };
+    AnnoRing *ring;
+    Point centre;
+    Point text_to;
+    Point text_from;
+    int *used;
+    int anchor[ANNO_ANCHORS];
+    int extent;
+    int side;
+    int r = 0;
+    int d = 0;
+    int i = 0;
+    int n = 0;
+
+    for (ring = anno_rings; ring != NULL; ring = ring->next) {
+        if (ring->radius == radius && ring->text_width == text_width && 
+            ring->text_height == text_height) {
+            return ring;
+        }
+    }
 
-    in_color = gdImageGetPixel(im, x, y);
+    ring = (AnnoRing *) malloc(sizeof (AnnoRing));
+    ring->candidate = (AnnoCandidate *) malloc(MAX_LEADER * (360 / ANNO_ANGLE) 
+                                               * sizeof (AnnoCandidate));
+    if (ring->candidate == NULL) {
+        fprintf(stderr,"**** Error out of memory for annotation positions\n**** Aborting\n");
+        exit(1);
+    }
+    ring->radius = radius;
+    ring->text_width = text_width;
+    ring->text_height = text_height;
+    ring->num = 0;
 
-    out_r = (gdImageRed(im, in_color) * pct_original
-             + r * (100 - pct_original)) / 100;
+    /* map of text box corners already used to the candidate + 1
+     */
+    extent = radius + MAX_LEADER + MAX(text_width, text_height);
+    side = 2 * extent + 1;
+    used = (int *) calloc(side * side, sizeof (int));
+    if (used == NULL) {
+        fprintf(stderr,"**** Error out of memory for annotation positions\n**** Aborting\n");
+        exit(1);
+    }
 
-    out_g = (gdImageGreen(im, in_color) * pct_original
-             + g * (100 - pct_original)) / 100;
+    centre.x = 0;
+    centre.y = 0;
 
-    out_b = (gdImageBlue(im, in_color) * pct_original
-             + b * (100 - pct_original)) / 100;
+    /* grow the radius 1 pixel to the limit
+     */
+    for (r = radius; r < (radius + MAX_LEADER); r++) {
 
-    out_color = gdImageColorExact(im, out_r, out_g, out_b);
-    if (out_color == -1) {
-        out_color = gdImageColorAllocate(im, out_r, out_g, out_b);
-        if (out_color == -1) {
-            out_color = gdImageColorClosest(im, out_r, out_g, out_b);
+        /* degree increments for this radius the +ve x-axis is 0 degrees
+         * -ve y-axis 90 degrees
+         */
+        for (d = 0; d < 360; d += ANNO_ANGLE) {
+            AnnoCandidate *candidate = &ring->candidate[ring->num];
+            double angle;
+
+            /* calculate the end of the leader line position and the position
+             * of the text as a box at this position. 
+             */
+            angle = ((double)d / 180.0) * M_PI;
+            text_from.x = Rint ((double)r * cos(angle));
+            text_from.y = Rint ((double)r * sin(angle));
+
+            if ( d >= 0 && d <= 90) {
+                /* first quadrant hang text box from bottom left
+                 */
+                text_to.x = text_from.x + text_width; 
+                text_to.y = text_from.y + text_height;
+
+            }else if ( d > 90 && d <= 180) {
+                /* second quadrant hang text box from top left
+                 */	
+                text_to.x = text_from.x - text_width; 
+                text_to.y = text_from.y + text_height;
+
+            }else if ( d > 180 && d <= 270) {
+                /* third quadrant hang text box from top right
+                 */
+                text_to.x = text_from.x - text_width;
+                text_to.y = text_from.y - text_height;
+
+            }else{
+                /* fourth quadrant hang text box from bottom right
+                 */
+                text_to.x = text_from.x + text_width; 
+                text_to.y = text_from.y - text_height;
+            }
+            candidate->text = Box_boxPoint(text_from,text_to);
+            n = (candidate->text.min_y + extent) * side + 
+                candidate->text.min_x + extent;
+
+            /* note the anchor positions on the innermost ring 
+             */
+            if (r == radius) {
+                for (i = 0; i < ANNO_ANCHORS; i++) {
+                    if (d == anchor_angle[i]) {
+                        anchor[i] = used[n] ? used[n] - 1 : ring->num;
+                    }
+                }
+            }
+            if (used[n]) {
+                continue;
+            }
+            used[n] = ring->num + 1;
+            candidate->leader = 
+                Box_boxPoint(centre, Box_closestMidPoint(candidate->text, centre)); 
+            ring->num++;
         }
     }
-    gdImageSetPixel(im, x, y, out_color);
-}
-
+    free(used);
+    ring->candidate = (AnnoCandidate *) realloc(ring->candidate, 
+                                                ring->num * sizeof (AnnoCandidate));
 
-/*
-------------------------------------------------------------------------------
-Fade out pixels under box
+    /* search order for branch and bound, the anchors then the radial sweep
+     */
+    ring->anchor_order = (int *) malloc(ring->num * sizeof (int));
+    if (ring->anchor_order == NULL) {
+        fprintf(stderr,"**** Error out of memory for annotation positions\n**** Aborting\n");
+        exit(1);
+    }
+    for (i = 0, n = 0; i < ANNO_ANCHORS; i++) {
+        int j;
 
-*/
-void fadeBox(gdImagePtr im, Box box, int pct_fade)
-{
-    int x,
-        y;
+        for (j = 0; j < i && anchor[j] != anchor[i]; j++);
+        if (j == i) {
+            ring->anchor_order[n++] = anchor[i];
+        }
+    }
+    for (i = 0; i < ring->num; i++) {
+        int j;
 
-    for (x = box.min_x; x <= box.max_x; x++) {
-        for (y = box.min_y; y <= box.max_y; y++) {
-            mergePixelColor(im, x, y, 0, 0, 0, (100 - pct_fade));
+        for (j = 0; j < ANNO_ANCHORS && anchor[j] != i; j++);
+        if (j == ANNO_ANCHORS) {
+            ring->anchor_order[n++] = i;
         }
     }
+
+    ring->next = anno_rings;
+    anno_rings = ring;
+    if (debug) {
+        printf("Annotation positions radius %d text %dx%d %d unique\n",
+               radius, text_width, text_height, ring->num);
+    }
+    return ring;
 }
 
 
-/*
+/* getAnnoPosition()
 ------------------------------------------------------------------------------
-Fade out pixels under circle, uses a scanline and the circle radius
+Find best position for annotation
+
+Try the candidate positions around the game object in turn. If a good 
+position is found then use it other wise exhaust search and use the best 
+position found. Clashes are against the box manager and the optional overlay
+of labels private to this search.
+
+Take the effect of the leader line from the candidate positions into account 
+but it is weighted to be less important than the text clashing
+
+In branch and bound mode the classic anchor positions are tried first and a
+candidate is dropped as soon as its clash can't beat the best so far, any 
+position with a clash no more than good_overlap is taken straight away
+
+Return:
+ number of the candidate position in the ring, -1 if there are none
 
 */
-void fadeCircle(gdImagePtr im, int xc, int yc, int r, int pct_fade)
+int getAnnoPosition
+    (
+    GameObject this_game_object, 
+	AnnoRing *ring,
+	BoxIndex *overlay
+    )
 {
-    int x,
-        y;
+	Box text_box;
+	Box leader_box;
+	int best = -1;
+    int overlap = 0;
+	int min_overlap = INT_MAX;
+	int i = 0;
+	int n = 0;
+	double weighting;
 
-    for (x = (xc - r); x <= (xc + r); x++) {
-        for (y = (yc - r); y <= (yc + r); y++) {
-            if (sqrt((x - xc) * (x - xc) + (y - yc) * (y - yc)) <= r) {
-                mergePixelColor(im, x, y, 0, 0, 0, (100 - pct_fade));
-            }
-        }
-    }
+	/* consider lines only if drawing them 
+	 */
+	weighting = (leader_color != NOT_DEFINED) ? LEADER_WEIGHTING : 0.0;
+
+	for (n = 0; n < ring->num; n++) {
+		i = bound_search ? ring->anchor_order[n] : n;
+		text_box = Box_translate(ring->candidate[i].text, 
+								 this_game_object.cen_x, this_game_object.cen_y);
+		/*** if (debug) Box_draw(text_box,im_out); ***/
+		leader_box = Box_translate(ring->candidate[i].leader, 
+								   this_game_object.cen_x, this_game_object.cen_y);
+
+		/* get amount of clash with existing boxes and keep the best so 
+		 * far take the leader line into account in determining the clash
+		 * amount but weight it differently than for text. 
+		 * if there is no clash then use the current point now
+		 */
+		overlap = BoxMgr_labelOverlap(overlay, text_box, leader_box, weighting,
+									  bound_search ? min_overlap : INT_MAX);
+
+		if (overlap <= good_overlap) {
+			/* this box doesn't clash (much) so use it now
+			 */
+			best = i;
+			break;
+		}else{
+			/* if this is the best box yet then store the position
+			 */
+			if (overlap < min_overlap) {
+				min_overlap = overlap;
+				best = i;
+			}
+		}
+	}
+	return best;
 }
 
-/* 
+
+/* Label_place()
 ------------------------------------------------------------------------------
-Make string upper case, modifies the contents but not the base pointer
+Put a label at a candidate position of its ring, the text position is the 
+top left of the text box as this is the position gd uses to place text 
+images. With no candidate the label sits on the game object centre
 
 */
-void strupper(char *s1) 
+void Label_place(Label *label, int candidate)
 {
-	char *s2;
-
-	s2 = s1;
-	while (*s2) {
-		*s2 = toupper(*s2);
-		s2++;
+	label->candidate = candidate;
+	label->position.x = game_objects[label->game_object].cen_x;
+	label->position.y = game_objects[label->game_object].cen_y;
+	if (candidate >= 0) {
+		label->position.x += label->ring->candidate[candidate].text.min_x;
+		label->position.y += label->ring->candidate[candidate].text.min_y;
 	}
 }
 
-/* 
+
+/* Label_clashBoxes()
 ------------------------------------------------------------------------------
-Process Color section in resource file 
+Get the clash boxes of a placed label. Dilate the text box so that a small 
+border exists around text blocks, the leader line runs from the game object
+centre to the nearest mid point of a side of the dilated box
+
+Return:
+ true  - leader segment set
+ false - no leader line drawn
 
-if allocate then allocate the colors in the out image palette
- 
 */
-void colorSection(FILE *r_file, int allocate) 
+int Label_clashBoxes(Label *label, Box *text_box, Segment *leader)
 {
-	char line[256];
-	while (fgets(line, 255, r_file)) {
-		char* s;
-		char* d;
+	Point leader_end;
+	Point centre;
 
-		/* strip comments from line 
-		 */		  
-		strupper(line);
-		s = strstr(line,";");
-		if (s) {
-			*s = '\0';
-		}
-		
-		/* end of section - pop the line back and continue section processing
-		 */
-		if (strstr(line,"[")) {
-			fputs(line,r_file);
-			return;
-		}
-		
-		/* extract expected values this is three integers for r g b after an 
-         * '=' character 
-		 */
-		if (strlen(line) > 0 ) {
-			d = strstr(line,"=");
-			if (d) {
-				int r,g,b;
-				sscanf(++d,"%d%d%d",&r,&g,&b);
+	centre.x = game_objects[label->game_object].cen_x;
+	centre.y = game_objects[label->game_object].cen_y; 
 
-				if (strstr(line,"BACKGROUNDCOLOR")) {
-					if ( allocate ) background_color = gdImageColorAllocate(im_out, r, g, b);
-				}
-				if (strstr(line,"FOREGROUNDCOLOR")) {
-					if ( allocate ) foreground_color = gdImageColorAllocate(im_out, r, g, b);
-					foreground_rgb.r = r;
-					foreground_rgb.g = g;
-					foreground_rgb.b = b;
-				}
-				if (strstr(line,"TITLETEXTCOLOR")) {
-					if ( allocate ) title_text_color = gdImageColorAllocate(im_out, r, g, b);
-				}
-				if (strstr(line,"LABELTEXTCOLOR")) {
-					if ( allocate ) label_text_color = gdImageColorAllocate(im_out, r, g, b);
-				}
-				if (strstr(line,"AXESCOLOR")) {
-					if ( allocate ) axes_color =  gdImageColorAllocate(im_out, r, g, b);
-				}
-				if (strstr(line,"AXESTEXTCOLOR")) {
-					if ( allocate ) axes_text_color = gdImageColorAllocate(im_out, r, g, b);
-				}
-				if (strstr(line,"LEGENDCOLOR")) {
-					if ( allocate ) legend_color = gdImageColorAllocate(im_out, r, g, b);
-				}
-				if (strstr(line,"LEGENDTEXTCOLOR")) {
-					if ( allocate ) legend_text_color = gdImageColorAllocate(im_out, r, g, b);
-				}
-				if (strstr(line,"LEADERCOLOR")) {
-					if ( allocate ) leader_color = gdImageColorAllocate(im_out, r, g, b);
-				}
-				if (strstr(line,"COURSECOLOR")) {
-					if ( allocate ) course_color = gdImageColorAllocate(im_out, r, g, b);
-				}
-				if (strstr(line,"GRIDCOLOR")) {
-					if ( allocate ) axes_grid_color = gdImageColorAllocate(im_out, r, g, b);
-				}
-				if (strstr(line,"LOCUSCOLOR")) {
-					if ( allocate ) locus_color = gdImageColorAllocate(im_out, r, g, b);
-				}
-			}else{
-				fprintf(stderr,"**** Warning bad resource file entry \n%s\n",line);
-			}
-		}
+	*text_box = Box_dilate(Box_boxInt(label->position.x, label->position.y, 
+									  label->position.x + label->ring->text_width,
+									  label->position.y + label->ring->text_height),
+						   TEXT_DILATION);
+	if (leader_color == NOT_DEFINED) {
+		return FALSE;
 	}
+	leader_end = Box_closestMidPoint(*text_box, centre);
+	*leader = Segment_create(leader_end.x, leader_end.y, centre.x, centre.y, 
+							 LINE_DILATION);
+	return TRUE;
 }
 
 
-
-/* 
+/* Label_addOverlay()
 ------------------------------------------------------------------------------
-Read resource file information
- 
-*/
-void readResource(int allocate) {
-	 char line[256];
-	 FILE * r_file;
-
-	 if (verbose) printf("Reading resource file %s\n",resource_filename);
-	 r_file = fopen(resource_filename, "r");
-
-	 /* read line until EOL || EOF
-	  */
-     while (fgets(line, 255, r_file)) {
-		 char* s;
+Add or remove the clash boxes of a placed label to a box manager overlay
 
-		 /* strip comments from line 
-		  */
-		 strupper(line);
-         s = strstr(line,";");
-         if (s) {
-			 *s = '\0';
-		 }
+*/
+void Label_addOverlay(Label *label, BoxIndex *overlay)
+{
+	Box text_box;
+	Segment leader;
 
-		 /* find section header 
-		  */
-		 if (strstr(line,"[")) {
-			 if (strstr(line,"]")) {
+	if (Label_clashBoxes(label, &text_box, &leader)) {
+		BoxMgr_addSegmentOverlay(overlay, leader);
+	}
+	BoxMgr_addOverlay(overlay, text_box);
+}
 
-				 /* process sections
-				  */
-				 if (strstr(line,"COLOR")) {
-					 colorSection(r_file, allocate);
-				 }
-			 }else{
-				 fprintf(stderr,"**** Error bad resource section %s\n",line);
-			 }
-		 }
-	 }
-	 fclose(r_file);
+void Label_removeOverlay(Label *label, BoxIndex *overlay)
+{
+	Box text_box;
+	Segment leader;
+
+	if (Label_clashBoxes(label, &text_box, &leader)) {
+		BoxMgr_removeSegmentOverlay(overlay, leader);
+	}
+	BoxMgr_removeOverlay(overlay, text_box);
 }
 
-/*
+
+/* Label_overlap()
 ------------------------------------------------------------------------------
-Load game object images
+Get the clash of a label at one of its candidate positions, scored as in the
+search against the box manager and an optional overlay
+
+Return:
+ weighted overlap area, or a value >= bound
 
 */
-void loadGameImages ()
+int Label_overlap(Label *label, int candidate, BoxIndex *overlay, int bound)
 {
-	FILE* out_file;
-    char temp_name[MAX_BUFFER - 1];
-	
-	/* TODO get the foreground color set to white as a default */
-	foreground_rgb.r = 255;
-    foreground_rgb.g = 255;
-    foreground_rgb.b = 255;
-	
-	if (resource_filename && color) {
-		readResource(0);
-	}
-	if (verbose) printf("Foreground color is %d %d %d\n", foreground_rgb.r,foreground_rgb.g, foreground_rgb.b);
-	
-
-    /* Read and pre-rotate to 12 possible heading positions the game object 
-     * gifs. If creating a bitonal map make negative images from the 
-     * conventional, white on black. Add the image colors to the color manager
-     * so that the main image palette will be the best fit for the images used
-     */
-    num_classes = 0;
-    if (verbose) printf("Reading game object images\n");
-    do {
-        char game_object_filename[MAX_BUFFER];
-        gdImagePtr temp_image=NULL;
-        double gif_scale=0.0;
-        int heading=0;    
-        double angle=0.0;
-        int temp_x=0;
+	GameObject this_game_object = game_objects[label->game_object];
+
+	return BoxMgr_labelOverlap(overlay, 
+							   Box_translate(label->ring->candidate[candidate].text,
+											 this_game_object.cen_x,
+											 this_game_object.cen_y),
+							   Box_translate(label->ring->candidate[candidate].leader,
+											 this_game_object.cen_x,
+											 this_game_object.cen_y),
+							   (leader_color != NOT_DEFINED) ? LEADER_WEIGHTING : 0.0,
+							   bound);
+}
 
-        scanf("%s\n",temp_name);
-        if (temp_name[0] != '*') {
-            class[num_classes].name = (char *) strdup(temp_name);
-            scanf("%s\n", temp_name);
-            if (image_dir) {
-                sprintf(game_object_filename,"%s%s%s",image_dir,SLASH,
-                        temp_name);
-            } else {
-                strcpy(game_object_filename,temp_name);
-            }
 
-            in_file = fopen(game_object_filename, "rb");
-            if (!in_file) {
-                fprintf(stderr,"**** Error unable to load source image %s\n**** Aborting\n",
-                        game_object_filename);
-                temp_image = 0;
-                exit(0);
-            } else {
-                temp_image = gdImageCreateFromGif(in_file);
-                fclose(in_file);
-            }
-            if (verbose) printf("\t%s %s",game_object_filename,
-                   temp_image == NULL ?"not read":"read");
+/* Label_cost()
+------------------------------------------------------------------------------
+Get the clash of a placed label scored as in the search, against the box 
+manager and the other labels in the overlay
 
-            /* invert bitmap if bitonal 
-             */
-			int b,w,f; 
-            if (!color) {
-                b = gdImageColorExact(temp_image,0,0,0);
-                if (b == -1) {
-                    b = gdImageColorAllocate(temp_image,0,0,0);
-                    if (b == -1) {
-                        b = gdImageColorClosest(temp_image,0,0,0);
-                    }
-                }
-                w = gdImageColorExact(temp_image,255,255,255);
-                if (w == -1) {
-                    w = gdImageColorAllocate(temp_image,255,255,255);
-                    if (w == -1) {
-                        w = gdImageColorClosest(temp_image,255,255,255);
-                    }
-                }
-                changeColor(temp_image,b,w,1);
-            }
-			
-			/* TODO
-			 if color and a foreground re-color in effect then change color on the loaded sprite before rotation
-			 Note we don't have the foreground color rgb yet - need to refactor that so it's read before 
-			*/
-			
-			/* if colors and the foreground isn't white swap it with white with the just loaded sprite */
-			if (color && !(foreground_rgb.r == 255 && foreground_rgb.g == 255 && foreground_rgb.b == 255 )) {
-				f = gdImageColorAllocate(temp_image,foreground_rgb.r,foreground_rgb.g,foreground_rgb.b);
-                    if (f == -1) {
-                        f = gdImageColorClosest(temp_image,foreground_rgb.r,foreground_rgb.g,foreground_rgb.b);
-                    }
-				w = gdImageColorExact(temp_image,255,255,255);
-                if (w == -1) {
-                    w = gdImageColorAllocate(temp_image,255,255,255);
-                    if (w == -1) {
-                        w = gdImageColorClosest(temp_image,255,255,255);
-                    }
-                }
-				changeColor(temp_image,f,w,1);
-			}
-			
-			
-			
-			
-            /* add image palette to color manager
-             */
-            ColorMgr_getImageColorMap(temp_image, IMAGE_PALETTE_SIZE);
+Return:
+ weighted overlap area
 
-            scanf("%lf\n", &gif_scale);
-            for (heading = 0; heading < 12; heading++) {
-                angle = ((double) (M_PI / 6.0)) * heading;
-                class[num_classes].image[heading] = 
-                    spinImage(temp_image, angle, gif_scale, resample);
-					if (debug) {
-						sprintf(temp_name,"%s%d.gif",class[num_classes].name, heading);
-						out_file = fopen(temp_name, "wb");
-						gdImageGif(class[num_classes].image[heading], out_file);
-						fclose(out_file);
-					}
-                    if (verbose) printf(".");
-            }
-            if (verbose) printf("\n");
-            gdImageDestroy(temp_image);
-            class[num_classes].radius = 
-                gdImageSX(class[num_classes].image[0]) / 2;
+*/
+int Label_cost(Label *label, BoxIndex *overlay)
+{
+	int cost;
 
-            scanf("%d\n", &temp_x);
-            if (temp_x) {
-                index_class[num_indexed_classes] = num_classes;
-                num_indexed_classes++;
-            }
-            num_classes++;
-        }
-    } while (temp_name[0] != '*');
+	if (label->candidate < 0) {
+		return 0;
+	}
+	Label_removeOverlay(label, overlay);
+	cost = Label_overlap(label, label->candidate, overlay, INT_MAX);
+	Label_addOverlay(label, overlay);
+	return cost;
 }
 
 
-/*
+/* Label_search()
 ------------------------------------------------------------------------------
-Load game object data
+Search for the best position of a label against the box manager and an 
+optional overlay. A position kept from the last layout is used if it 
+clashes no more than it did last time, or has a good clash. The search is 
+made whatever the label time budget, only the improvement after it is cut
+short by the deadline
 
 */
-void loadGameObjects()
-{   
-    char temp_name[256];
-	float temp;
+void Label_search(Label *label, BoxIndex *overlay)
+{
+	int bound;
 
-    /* Get game object data from data file 
-     */
-    num_game_objects = 0;
-    if (verbose) printf("reading game objects\n");
-    do {
-        GameObject this_game_object;
-        int class_num=0;
-        int heading=0;
+	if (label->warm >= 0) {
+		bound = MAX(label->warm_clash, good_overlap);
+		label->clash = Label_overlap(label, label->warm, overlay, bound + 1);
+		if (label->clash <= bound) {
+			Label_place(label, label->warm);
+			return;
+		}
+	}
+	Label_place(label, getAnnoPosition(game_objects[label->game_object], 
+									   label->ring, overlay));
+	label->clash = (label->candidate < 0) ? 0 :
+		Label_overlap(label, label->candidate, overlay, INT_MAX);
+}
 
-        fgets(temp_name,80,stdin);
-        temp_name[strlen(temp_name)-1] = '\0';
-        if (temp_name[0] != '*') {
-            this_game_object.name = strdup(temp_name);
 
-            scanf("%s\n", temp_name);
-            for (class_num = 0; class_num < num_classes; class_num++) {
-                if (strcmp(class[class_num].name, temp_name) == 0) {
-                    for (heading = 0; heading < 12; heading++) {
-                        this_game_object.image[heading] = 
-                            class[class_num].image[heading];
-                    }
-                    this_game_object.radius = class[class_num].radius;
-                    break;
-                }
-            }
+/* Label_find()
+------------------------------------------------------------------------------
+Find union find root label of a cluster
 
-            scanf("%f\n", &temp);
-            this_game_object.x = (double)temp;
-            scanf("%f\n", &temp);
-            this_game_object.y = (double)temp;
-            this_game_object.cen_x = 
-                (int) (0.5 + (this_game_object.x - min_x) * pix_per_unit);
-            this_game_object.cen_y = 
-                out_y - (int)(0.5 + (this_game_object.y -min_y) * pix_per_unit);
-            scanf("%d\n", &(this_game_object.heading));
-            scanf("%d\n", &(this_game_object.facing));
-            scanf("%f\n", &temp);
-            this_game_object.speed = (double)temp;
-            scanf("%d\n", &(this_game_object.delta_heading));
-         
-            /* Store game object and load its color map into the color manager
-             */                 
-            game_objects[num_game_objects++] = this_game_object;
-        }
-    } while (temp_name[0] != '*');
+*/
+static int Label_find(Label *label, int i)
+{
+	while (label[i].cluster != i) {
+		label[i].cluster = label[label[i].cluster].cluster;
+		i = label[i].cluster;
+	}
+	return i;
 }
 
 
-/*
+/* compareLabelX()
 ------------------------------------------------------------------------------
-Fade game object background in gif image
+qsort comparison of label numbers by left edge of extent, with the extents 
+held in the first element
 
 */
-void fadeGameObjects() 
-{
-    int game_object_num;
+static Label *sort_labels = NULL;
 
-    /* Fade Game Object background 
-     */
-    if (verbose) printf("fading background for game objects\n");
-    for (game_object_num = 0; game_object_num < num_game_objects; 
-         game_object_num++) {
-        GameObject this_game_object;
-		
-        this_game_object = game_objects[game_object_num];
+static int compareLabelX(const void *a, const void *b)
+{
+	int ia = *(const int *) a;
+	int ib = *(const int *) b;
 
-        /* if a background image then fade out the background under the 
-         * image so it isn't swamped by the background do this before
-         * adding the images or they get faded too
-         */
-		fadeCircle(im_out, this_game_object.cen_x, this_game_object.cen_y, 
-				   this_game_object.radius, GAME_OBJECT_FADE);
+	if (sort_labels[ia].extent.min_x != sort_labels[ib].extent.min_x) {
+		return sort_labels[ia].extent.min_x - sort_labels[ib].extent.min_x;
 	}
-}	
-
+	return ia - ib;
+}
 
 
-/*
+/* compareClusterSize()
 ------------------------------------------------------------------------------
-Draw game objects in new gif image
+qsort comparison of clusters biggest first
 
 */
-void drawGameObjects() 
-{    
-    int temp_x=0;
-    int temp_y=0;
-    int game_object_num;
+static int *sort_first = NULL;
 
-    /* Plot Game_Object Images 
-     */
-    if (verbose) printf("Drawing game objects\n");
-    for (game_object_num = 0; game_object_num < num_game_objects; 
-         game_object_num++) {
-        GameObject this_game_object;
+static int compareClusterSize(const void *a, const void *b)
+{
+	int ca = *(const int *) a;
+	int cb = *(const int *) b;
+	int na = sort_first[ca + 1] - sort_first[ca];
+	int nb = sort_first[cb + 1] - sort_first[cb];
 
-        this_game_object = game_objects[game_object_num];
-        temp_x = this_game_object.cen_x - this_game_object.radius;
-        temp_y = this_game_object.cen_y - this_game_object.radius;
-
-		/* change foreground color - should be moved to where images are processed for facings  as it craps up AA */
-		 
-		if (color && foreground_color != NOT_DEFINED) {
-			changeForeground
-				(this_game_object.image[this_game_object.facing % 12]);
-		}
+	if (na != nb) {
+		return nb - na;
+	}
+	return ca - cb;
+}
 
-        gdImageCopy(im_out, 
-                    this_game_object.image[this_game_object.facing % 12],
-                    temp_x, temp_y, 0, 0, this_game_object.radius * 2, 
-                    this_game_object.radius * 2);
 
-        /* Plot game object course after image so ship locus is clear
-         * as course terminates there
-         */
-        if (tracking) {
-            plotCourse(im_out, this_game_object, course_color);
-        }        
+/* findLabelNeighbours()
+------------------------------------------------------------------------------
+Find the labels whose search areas overlap each label, only these can clash
+with it. The neighbours of label i are neighbour[first[i]..first[i+1]-1]
 
-        /* Add game object bounding box to text box manager
-         */
-        BoxMgr_add(Box_boxInt(temp_x,temp_y,
-                              temp_x + 2 * this_game_object.radius,
-                              temp_y + 2 * this_game_object.radius));
-    }
+*/
+void findLabelNeighbours(Label *label, int num_labels, int **first, int **neighbour)
+{
+	int *by_x;
+	int *next;
+	int pass;
+	int i,
+		j;
+
+	by_x = (int *) malloc(num_labels * sizeof (int));
+	for (i = 0; i < num_labels; i++) {
+		by_x[i] = i;
+	}
+	sort_labels = label;
+	qsort(by_x, num_labels, sizeof (int), compareLabelX);
+
+	/* sweep the labels left to right, first counting the neighbours then 
+	 * filling them in
+	 */
+	*first = (int *) calloc(num_labels + 1, sizeof (int));
+	*neighbour = NULL;
+	next = NULL;
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < num_labels; i++) {
+			Label *a = &label[by_x[i]];
+
+			for (j = i + 1; j < num_labels; j++) {
+				Label *b = &label[by_x[j]];
+
+				if (b->extent.min_x >= a->extent.max_x) {
+					break;
+				}
+				if (b->extent.min_y < a->extent.max_y && 
+					a->extent.min_y < b->extent.max_y) {
+					if (pass == 0) {
+						(*first)[by_x[i] + 1]++;
+						(*first)[by_x[j] + 1]++;
+					}else{
+						(*neighbour)[next[by_x[i]]++] = by_x[j];
+						(*neighbour)[next[by_x[j]]++] = by_x[i];
+					}
+				}
+			}
+		}
+		if (pass == 0) {
+			for (i = 0; i < num_labels; i++) {
+				(*first)[i + 1] += (*first)[i];
+			}
+			*neighbour = (int *) malloc((*first)[num_labels] * sizeof (int) + 1);
+			next = (int *) malloc((num_labels + 1) * sizeof (int));
+			memcpy(next, *first, num_labels * sizeof (int));
+		}
+	}
+	free(next);
+	free(by_x);
 }
 
 
-/*
+/* clusterLabels()
 ------------------------------------------------------------------------------
-Read data file header information
- 
-*/
-void readHeader() {
-    char temp_name[MAX_BUFFER - 1];
-    char background_filename[MAX_BUFFER];
-	float temp;
+Group labels into clusters whose search areas connect. Labels in different 
+clusters can never clash with each other so clusters can be placed on their 
+own, each in object order, and give the same result as placing every label 
+in object order
 
-    /* Get Map Title 
-     */
-    fgets(temp_name, 80, stdin);
-    title = strdup(temp_name);
-    if (!isprint(title[strlen(title) - 1])) {
-        title[strlen(title) - 1] = '\0';
-    }
-    
+Return:
+ number of clusters
 
-    /* Get Background image (if any) and color 
-     */
-    scanf("%s\n", temp_name);
-    if (color) {
-        if (temp_name[0] != '-') {
-            if (image_dir) {
-                sprintf(background_filename,"%s%s%s",image_dir,SLASH,temp_name);
-            } else {
-                strcpy(background_filename,temp_name);
-            }
-            in_file = fopen(background_filename, "rb");
-            if (!in_file) {
-                fprintf(stderr, "**** Error unable to load background image %s\n",
-                        background_filename );
-                background = NULL;
-            } else {
-                /* Create background image and add its color map to the oct-tree
-                 */
-                background = gdImageCreateFromGif(in_file);
-                fclose(in_file);
-                ColorMgr_getImageColorMap(background, IMAGE_PALETTE_SIZE);
-            }
-        } else {
-            background = NULL;
-        }
-    }else{
-        background = NULL;
-    }
-    
-    /* Get tracking flag 
-     */
-    scanf("%d\n", &tracking);
-    tracking = tracking ? 1 : 0;
-    
-    /* Get Map Corner Co-Ords 
-     */
-    scanf("%f\n", &temp);
-	min_x = (double)temp;
-    scanf("%f\n", &temp);
-    min_y = (double)temp;
-    scanf("%f\n", &temp);
-    max_x  = (double)temp;
-    scanf("%f\n", &temp);
-    max_y = (double)temp;
-    
+*/
+int clusterLabels(Label *label, int num_labels, LabelJobs *jobs)
+{
+	int *first;
+	int *neighbour;
+	int *next;
+	int num_clusters = 0;
+	int i,
+		n;
+
+	/* join every label to its neighbours
+	 */
+	findLabelNeighbours(label, num_labels, &first, &neighbour);
+	for (i = 0; i < num_labels; i++) {
+		label[i].cluster = i;
+	}
+	for (i = 0; i < num_labels; i++) {
+		for (n = first[i]; n < first[i + 1]; n++) {
+			int ra = Label_find(label, i);
+			int rb = Label_find(label, neighbour[n]);
 
-    /* Get pixels/unit ratio 
-     */
-    scanf("%f\n", &temp);
-    pix_per_unit = (double)temp;
-    out_x = (int) (0.5 + pix_per_unit * (max_x - min_x));
-    out_y = (int) (0.5 + pix_per_unit * (max_y - min_y));
+			/* lowest label is the root so cluster order is object order
+			 */
+			if (ra < rb) {
+				label[rb].cluster = ra;
+			}else if (rb < ra) {
+				label[ra].cluster = rb;
+			}
+		}
+	}
+	free(first);
+	free(neighbour);
+	/* number the clusters in order of their first label and list their 
+	 * members in object order
+	 */
+	next = (int *) calloc(num_labels + 1, sizeof (int));
+	for (i = 0; i < num_labels; i++) {
+		if (Label_find(label, i) == i) {
+			next[i] = num_clusters++;
+		}
+	}
+	jobs->first = (int *) calloc(num_clusters + 1, sizeof (int));
+	for (i = 0; i < num_labels; i++) {
+		label[i].cluster = next[Label_find(label, i)];
+		jobs->first[label[i].cluster + 1]++;
+	}
+	for (i = 0; i < num_clusters; i++) {
+		jobs->first[i + 1] += jobs->first[i];
+		next[i] = jobs->first[i];
+	}
+	jobs->member = (int *) malloc(num_labels * sizeof (int));
+	for (i = 0; i < num_labels; i++) {
+		jobs->member[next[label[i].cluster]++] = i;
+	}
+	free(next);
 
-    /* Announce parameters
-     */
-    if (verbose) {
-        printf("title                %s\n",title);
-        printf("map extent           %f.1/%f.1 %f.1/%f.1\n",min_x, min_y, max_x, max_y);
-        printf("image resolution     %d x %d\n", out_x, out_y);
-        printf("map                  %s\n",color       ? "color" : "bitonal" );
-        printf("background           %s\n",background  ? background_filename : "plain" );
-        if (background) {
-        printf("tiling               %s\n",wallpaper   ? "on" : "off" );
-        }
-        printf("resampling           %s\n",resample    ? "on" : "off" );    
-        printf("object tracks        %s\n",tracking    ? "on" : "off" );
-        if (tracking) {
-        printf("real thrust plotting %s\n",real_thrust ? "on" : "off" );
-        }
-        printf("grid                 %s\n",grid        ? "on" : "off" );
-        printf("legend               %s\n",legend      ? "on" : "off" );
-        printf("\n");
-    }
+	/* biggest clusters first to keep the threads busy
+	 */
+	jobs->cluster = (int *) malloc(num_clusters * sizeof (int));
+	for (i = 0; i < num_clusters; i++) {
+		jobs->cluster[i] = i;
+	}
+	sort_first = jobs->first;
+	qsort(jobs->cluster, num_clusters, sizeof (int), compareClusterSize);
+	jobs->label = label;
+	return num_clusters;
 }
 
 
-/* setStyles()
+/* placeLabelCluster()
 ------------------------------------------------------------------------------
-Set up complex linestyles
- 
+Job to place the labels of one cluster in object order, the labels already 
+placed in the cluster are kept in a private overlay of the box manager
+
 */
-void setStyles()
+void placeLabelCluster(int job, void *arg)
 {
-    /* Linestyle definitions & default style set according to color/bitonal
-     */
-    lcourse[0] = course_color;      
-    lcourse[1] = gdTransparent;
-    lcourse[2] = gdTransparent;
-    lcourse[3] = gdTransparent;
-    lgrid[0] = axes_grid_color;           
-    lgrid[1] = color ? axes_grid_color : gdTransparent;
-    lleader[0] = leader_color;        
-    lleader[1] = leader_color;
+	LabelJobs *jobs = (LabelJobs *) arg;
+	BoxIndex *overlay = NULL;
+	Box area;
+	int cluster = jobs->cluster[job];
+	int first = jobs->first[cluster];
+	int last = jobs->first[cluster + 1];
+	int m;
+
+	if (last - first > 1) {
+		area = jobs->label[jobs->member[first]].extent;
+		for (m = first + 1; m < last; m++) {
+			Box extent = jobs->label[jobs->member[m]].extent;
+
+			area = Box_union(area, extent);
+		}
+		overlay = BoxMgr_newOverlay(area);
+	}
+	for (m = first; m < last; m++) {
+		Label *label = &jobs->label[jobs->member[m]];
+
+		Label_search(label, overlay);
+		if (overlay) {
+			Label_addOverlay(label, overlay);
+		}
+	}
+	if (overlay) {
+		BoxMgr_freeOverlay(overlay);
+	}
 }
 
 
-/* getAnnoPosition()
+/* compareLayoutName()
 ------------------------------------------------------------------------------
-Find best position for annotation
+qsort comparison of layout entries by name then file order
 
-Use a radial approach with a 360d rotation leader line increasing in radius 
-from the game object radius to the maximum leader length. If a good position 
-is found then use it other wise exhaust search and use the best position 
-found. 
+*/
+static int compareLayoutName(const void *a, const void *b)
+{
+	const LayoutEntry *ea = (const LayoutEntry *) a;
+	const LayoutEntry *eb = (const LayoutEntry *) b;
+	int c = strcmp(ea->name, eb->name);
 
-Take the effect of the leader line from the candidate positions into account 
-but it is weighted to be less important than the text clashing
+	return c ? c : ea->order - eb->order;
+}
+
+
+/* readLayout()
+------------------------------------------------------------------------------
+Read the label layout written by a previous run and give each label the 
+candidate at its old offset from the game object to try first. Labels are 
+matched by game object name, repeated names in object order. A missing file 
+is not an error, there is no layout on the first turn
+
+Layout file lines are
+  dx dy clash name
+the label text top left relative to the game object centre, the clash of the
+label when it was placed and the game object name. The leader line is not 
+kept, it is drawn to the text box so it follows from the offset
 
-                                                   
-                                    r              
-                               +----------+--------+ angle +d degrees
-                         centre           | text   |      |
-                                          +--------+      V
 */
-Point getAnnoPosition
-    (
-    GameObject this_game_object, 
-	int text_width, 
-	int text_height
-    )
+void readLayout(Label *label, int num_labels)
 {
-	Box text_box;
-	Box leader_box;
-	Point position;
-	Point centre;
-	Point text_to;
-	Point text_from;
-    int overlap = 0;
-	int min_overlap = INT_MAX;
-	int r = 0;
-	int d = 0;
-	int box_num=0;
+	FILE *layout_file;
+	LayoutEntry *entry = NULL;
+	LayoutEntry key;
+	char buffer[MAX_BUFFER];
+	int num_entries = 0;
+	int max_entries = 0;
+	int num_warm = 0;
+	int dx,
+		dy,
+		clash,
+		start;
+	int lo,
+		hi,
+		mid;
+	int i,
+		c;
+
+	for (i = 0; i < num_labels; i++) {
+		label[i].warm = -1;
+	}
+	if (layout_filename == NULL || 
+		(layout_file = fopen(layout_filename, "r")) == NULL) {
+		return;
+	}
+	while (fgets(buffer, MAX_BUFFER, layout_file)) {
+		buffer[strcspn(buffer, "\r\n")] = '\0';
+		if (sscanf(buffer, "%d %d %d %n", &dx, &dy, &clash, &start) < 3) {
+			continue;
+		}
+		if (num_entries == max_entries) {
+			max_entries = max_entries ? max_entries * 2 : COL_BLK_SIZE;
+			entry = (LayoutEntry *) realloc(entry, max_entries * sizeof (LayoutEntry));
+			if (entry == NULL) {
+				fprintf(stderr,"**** Error out of memory for label layout\n**** Aborting\n");
+				exit(1);
+			}
+		}
+		entry[num_entries].name = strdup(buffer + start);
+		entry[num_entries].dx = dx;
+		entry[num_entries].dy = dy;
+		entry[num_entries].clash = clash;
+		entry[num_entries].order = num_entries;
+		entry[num_entries].used = FALSE;
+		num_entries++;
+	}
+	fclose(layout_file);
+	qsort(entry, num_entries, sizeof (LayoutEntry), compareLayoutName);
 
-	centre.x = this_game_object.cen_x;
-	centre.y = this_game_object.cen_y;
+	for (i = 0; i < num_labels; i++) {
+		AnnoRing *ring = label[i].ring;
 
-	/* grow the radius 1 pixel to the limit
-	 */
-	for (r=this_game_object.radius; r < (this_game_object.radius + MAX_LEADER); 
-		 r++) {
+		/* first unused entry for the name
+		 */
+		key.name = game_objects[label[i].game_object].name;
+		lo = 0;
+		hi = num_entries;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (strcmp(entry[mid].name, key.name) < 0) {
+				lo = mid + 1;
+			}else{
+				hi = mid;
+			}
+		}
+		while (lo < num_entries && entry[lo].used && 
+			   strcmp(entry[lo].name, key.name) == 0) {
+			lo++;
+		}
+		if (lo == num_entries || strcmp(entry[lo].name, key.name) != 0) {
+			continue;
+		}
+		entry[lo].used = TRUE;
 
-		/* degree increments for this radius the +ve x-axis is 0 degrees
-         * -ve y-axis 90 degrees
+		/* the same offset is a candidate if the object and name are the 
+		 * same size as last time
 		 */
-		for (d=0; d < 360; d+=ANNO_ANGLE) {
-			double angle;
+		for (c = 0; c < ring->num; c++) {
+			if (ring->candidate[c].text.min_x == entry[lo].dx &&
+				ring->candidate[c].text.min_y == entry[lo].dy) {
+				label[i].warm = c;
+				label[i].warm_clash = entry[lo].clash;
+				num_warm++;
+				break;
+			}
+		}
+	}
+	if (verbose) printf("%d of %d labels have a position from layout %s\n", 
+						num_warm, num_labels, layout_filename);
+	for (i = 0; i < num_entries; i++) {
+		free(entry[i].name);
+	}
+	free(entry);
+}
 
-			/* calculate the end of the leader line position and the position
-             * of the text as a box at this position. 
-			 */
-			angle = ((double)d / 180.0) * M_PI;
-			text_from.x = Rint ((double)r * cos(angle) + (double)centre.x);
-			text_from.y = Rint ((double)r * sin(angle) + (double)centre.y);
 
-			if ( d >= 0 && d <= 90) {
-				/* first quadrant hang text box from bottom left
-				 */
-				text_to.x = text_from.x + text_width; 
-				text_to.y = text_from.y + text_height;
+/* writeLayout()
+------------------------------------------------------------------------------
+Write the label layout for the next run
 
-            }else if ( d > 90 && d <= 180) {
-				/* second quadrant hang text box from top left
-				 */	
-				text_to.x = text_from.x - text_width; 
-				text_to.y = text_from.y + text_height;
+*/
+void writeLayout(Label *label, int num_labels)
+{
+	FILE *layout_file;
+	GameObject this_game_object;
+	int i;
+
+	if ((layout_file = fopen(layout_filename, "w")) == NULL) {
+		fprintf(stderr,"**** Error unable to write label layout %s\n", 
+				layout_filename);
+		return;
+	}
+	for (i = 0; i < num_labels; i++) {
+		this_game_object = game_objects[label[i].game_object];
+		fprintf(layout_file, "%d %d %d %s\n", 
+				label[i].position.x - this_game_object.cen_x, 
+				label[i].position.y - this_game_object.cen_y,
+				label[i].clash, this_game_object.name);
+	}
+	fclose(layout_file);
+}
 
-			}else if ( d > 180 && d <= 270) {
-				/* third quadrant hang text box from top right
-				 */
-				text_to.x = text_from.x - text_width;
-				text_to.y = text_from.y - text_height;
 
-			}else{
-				/* fourth quadrant hang text box from bottom right
-				 */
-				text_to.x = text_from.x + text_width; 
-				text_to.y = text_from.y - text_height;
-			}
-			text_box = Box_boxPoint(text_from,text_to);
-			/*** if (debug) Box_draw(text_box,im_out); ***/
-			leader_box = Box_boxPoint(centre, 
-									  Box_closestMidPoint(text_box, centre)); 
-			/* get amount of clash with existing boxes and keep the best so 
-			 * far take the leader line into account in determining the clash
-             * amount but weight it differently than for text. 
-			 * if there is no clash then use the current point now
-			 */
-			overlap = 0;
-			for (box_num = 0; box_num < BoxMgr_numberBoxes(); box_num++) {
-				overlap += Box_overlap(BoxMgr_get(box_num),text_box);
-				
-				/* consider lines only if drawing them */
-				if ( leader_color != NOT_DEFINED ) {
-					overlap += (Box_overlap(BoxMgr_get(box_num),leader_box) * 
-								LEADER_WEIGHTING);
-					}
-                }
+/* improveLabel()
+------------------------------------------------------------------------------
+Try to move a label to a better position with every other label in place. 
+The move is kept only if it lowers the total clash of the label and its 
+neighbours, the only labels whose clash it can change
 
-			/* if the best position so far, calculate the best text position 
-			 * as the top left of the text box as this is postion gd uses to 
-			 * place text images
-			 */
-			if (overlap == 0) {
-				/* this box doesn't clash so use it now
-				 */
-				position.x = text_box.min_x;
-				position.y = text_box.min_y;
-				goto FOUND_IT;
-			}else{
-				/* if this is the best box yet then store the position
-				 */
-				if (overlap < min_overlap) {
-					min_overlap = overlap;
-					position.x = text_box.min_x;
-					position.y = text_box.min_y;
-				}
+Return:
+ true  - label moved
+ false - label left where it was
+
+*/
+int improveLabel(Label *label, int l, int *first, int *neighbour, int *cost, 
+				 BoxIndex *layer)
+{
+	int old_candidate = label[l].candidate;
+	int old_total = 0;
+	int new_total = 0;
+	int n;
+
+	for (n = first[l]; n < first[l + 1]; n++) {
+		old_total += cost[neighbour[n]];
+	}
+	old_total += cost[l];
+
+	Label_removeOverlay(&label[l], layer);
+	Label_place(&label[l], getAnnoPosition(game_objects[label[l].game_object],
+										   label[l].ring, layer));
+	Label_addOverlay(&label[l], layer);
+	if (label[l].candidate == old_candidate) {
+		return FALSE;
+	}
+
+	new_total = Label_cost(&label[l], layer);
+	for (n = first[l]; n < first[l + 1] && new_total < old_total; n++) {
+		new_total += Label_cost(&label[neighbour[n]], layer);
+	}
+	if (new_total >= old_total) {
+		Label_removeOverlay(&label[l], layer);
+		Label_place(&label[l], old_candidate);
+		Label_addOverlay(&label[l], layer);
+		return FALSE;
+	}
+	/* the clash of the moved label and its neighbours changed, keep it with 
+	 * the label too as the layout file records it for the next run
+	 */
+	cost[l] = Label_cost(&label[l], layer);
+	label[l].clash = cost[l];
+	for (n = first[l]; n < first[l + 1]; n++) {
+		cost[neighbour[n]] = Label_cost(&label[neighbour[n]], layer);
+		label[neighbour[n]].clash = cost[neighbour[n]];
+	}
+	return TRUE;
+}
+
+
+/* improveLabels()
+------------------------------------------------------------------------------
+Spend what is left of the label time budget on local search. The worst 
+clashing label not yet tried is moved to its best position given all the 
+other labels, a successful move lets its neighbours be tried again. Every
+kept move lowers the total clash so the labels always hold the best layout
+found when the deadline comes
+
+*/
+void improveLabels(Label *label, int num_labels, BoxIndex *layer)
+{
+	int *first;
+	int *neighbour;
+	int *cost;
+	char *tried;
+	int total = 0;
+	int moves = 0;
+	int worst;
+	int i,
+		n;
+
+	findLabelNeighbours(label, num_labels, &first, &neighbour);
+	cost = (int *) malloc((num_labels + 1) * sizeof (int));
+	tried = (char *) calloc(num_labels + 1, 1);
+	for (i = 0; i < num_labels; i++) {
+		cost[i] = Label_cost(&label[i], layer);
+		total += cost[i];
+	}
+	if (verbose) printf("label clash after first placement %d\n", total);
+
+	while (Clock_ms() < label_deadline) {
+		worst = -1;
+		for (i = 0; i < num_labels; i++) {
+			if (!tried[i] && cost[i] > 0 && 
+				(worst < 0 || cost[i] > cost[worst])) {
+				worst = i;
+			}
+		}
+		if (worst < 0) {
+			break;
+		}
+		tried[worst] = TRUE;
+		if (improveLabel(label, worst, first, neighbour, cost, layer)) {
+			moves++;
+			for (n = first[worst]; n < first[worst + 1]; n++) {
+				tried[neighbour[n]] = FALSE;
 			}
 		}
 	}
-	FOUND_IT:
-	return position;
+
+	if (verbose) {
+		for (i = 0, total = 0; i < num_labels; i++) {
+			total += cost[i];
+		}
+		printf("label clash after %d moves %d\n", moves, total);
+	}
+	free(first);
+	free(neighbour);
+	free(cost);
+	free(tried);
 }
 
 
 /* annotateGameObjects()
 ------------------------------------------------------------------------------
 Annotate the game objects with their names/id performing clash resolution
+
+The label positions are all found first then drawn in object order. With 
+more than one thread the labels are split into independent clusters which 
+are placed concurrently. With a label time budget the labels are kept in 
+their own layer until any time left after the first placement has been 
+spent improving them
  
 */
 void annotateGameObjects()
 {
     Box text_box;
+    Segment leader;
 	GameObject this_game_object;
-	Point anno_position;
+	Label *label;
+	LabelJobs jobs;
+	BoxIndex *layer = NULL;
 	Point leader_end;
 	Point centre;
     int game_object_num;
+    int num_labels=0;
+    int num_clusters=0;
     int text_width=0;
     int text_height=0;
+    int i=0;
 
     if (verbose) printf("annotating game objects\n");
-    for (game_object_num = 0; game_object_num < num_game_objects; game_object_num++) {
+    if (label_budget) {
+		label_deadline = Clock_ms() + label_budget;
+		layer = BoxMgr_newOverlay(Box_boxInt(-EDGE_DILATION, -EDGE_DILATION,
+											 out_x + EDGE_DILATION,
+											 out_y + EDGE_DILATION));
+	}
 
+    /* labels and the area each label search can reach
+     */
+    label = (Label *) malloc((num_game_objects + 1) * sizeof (Label));
+    for (game_object_num = 0; game_object_num < num_game_objects; game_object_num++) {
 		this_game_object = game_objects[game_object_num];
-		centre.x = this_game_object.cen_x;
-		centre.y = this_game_object.cen_y; 
-		
 		if (strlen(this_game_object.name) > 0) {		
 			text_width = strlen(this_game_object.name) * 
 				((gdFont *) gdFontSmall)->w;
 			text_height = ((gdFont *) gdFontSmall)->h;
-			anno_position = getAnnoPosition(this_game_object, text_width, 
-											text_height);
+			label[num_labels].game_object = game_object_num;
+			label[num_labels].ring = AnnoRing_get(this_game_object.radius, 
+												  text_width, text_height);
+			label[num_labels].extent = 
+				Box_dilate(Box_boxInt(this_game_object.cen_x - text_width,
+									  this_game_object.cen_y - text_height,
+									  this_game_object.cen_x + text_width,
+									  this_game_object.cen_y + text_height),
+						   this_game_object.radius + MAX_LEADER + 
+						   (int) ceil(LINE_DILATION * sqrt(2.0)) + 1);
+			num_labels++;
+		}
+	}
+
+	/* place labels, trying the positions from the last layout first
+	 */
+	readLayout(label, num_labels);
+	if (num_threads > 1) {
+		BoxMgr_flush();
+		num_clusters = clusterLabels(label, num_labels, &jobs);
+		if (verbose) printf("%d label clusters\n", num_clusters);
+		Jobs_run(num_clusters, placeLabelCluster, &jobs);
+		free(jobs.first);
+		free(jobs.member);
+		free(jobs.cluster);
+		if (layer) {
+			for (i = 0; i < num_labels; i++) {
+				Label_addOverlay(&label[i], layer);
+			}
+		}
+	}else{
+		for (i = 0; i < num_labels; i++) {
+			Label_search(&label[i], layer);
+			if (layer) {
+				Label_addOverlay(&label[i], layer);
+			}else if (Label_clashBoxes(&label[i], &text_box, &leader)) {
+				BoxMgr_add(text_box); 
+				BoxMgr_addSegment(leader);
+			}else{
+				BoxMgr_add(text_box); 
+			}
+		}
+	}
+	if (layer) {
+		improveLabels(label, num_labels, layer);
+		BoxMgr_freeOverlay(layer);
+	}
+	if (num_threads > 1 || layer) {
+		for (i = 0; i < num_labels; i++) {
+			if (Label_clashBoxes(&label[i], &text_box, &leader)) {
+				BoxMgr_add(text_box); 
+				BoxMgr_addSegment(leader);
+			}else{
+				BoxMgr_add(text_box); 
+			}
+		}
+	}
+	if (layout_filename) {
+		writeLayout(label, num_labels);
+	}
+
+	/* draw labels
+	 */
+    for (game_object_num = 0, i = 0; game_object_num < num_game_objects; 
+		 game_object_num++) {
 
-			/* Plot name and add to clash box manager, dilate the text box stored
-			 * so that a small border exists around text blocks, use the original
-			 * text box for the leader line calculation
+		this_game_object = game_objects[game_object_num];
+		centre.x = this_game_object.cen_x;
+		centre.y = this_game_object.cen_y; 
+		
+		if (i < num_labels && label[i].game_object == game_object_num) {
+
+			/* Plot name, use the original text box for fading
 			 */
-			text_box = Box_boxInt(anno_position.x,anno_position.y, 
-								  anno_position.x + text_width,
-								  anno_position.y + text_height);
+			text_box = Box_boxInt(label[i].position.x, label[i].position.y, 
+								  label[i].position.x + label[i].ring->text_width,
+								  label[i].position.y + label[i].ring->text_height);
 			if (background) {
 				fadeBox(im_out, text_box, LABEL_FADE);
 			}
-			gdImageString(im_out, gdFontSmall, anno_position.x, anno_position.y,
-						  this_game_object.name, label_text_color);
-			text_box = Box_dilate(text_box, TEXT_DILATION);
-			BoxMgr_add(text_box); 
+			gdImageString(im_out, gdFontSmall, label[i].position.x, 
+						  label[i].position.y, this_game_object.name, 
+						  label_text_color);
 
-			/* Draw leader line and add to clash box manager
+			/* Draw leader line
 			 */
-			
 			if (leader_color != NOT_DEFINED) {
-				leader_end = Box_closestMidPoint(text_box, centre);
+				leader_end = Box_closestMidPoint(Box_dilate(text_box, TEXT_DILATION), 
+												 centre);
 
 				gdImageSetStyle(im_out,lleader,lleader_size);
 				gdImageLine(im_out, leader_end.x, leader_end.y, centre.x, centre.y,
 							gdStyled);
-				if (Line_isOrthogonal(leader_end.x, leader_end.y, centre.x, centre.y)){
-            
-					/* line is orthogonal so dilate the clash box otherwise it has a 
-					 * zero dimension box
-					 */
-					BoxMgr_add(Box_dilate(Box_boxPoint(leader_end, centre),
-										  LINE_DILATION));
-				}else{
-					/* line not orthogonal use as is for clash box
-					 */
-					BoxMgr_add(Box_boxPoint(leader_end,centre));
-				}
 			}
+			i++;
 		}
 
 		/* Add locus spot at the center of the image
@@ -2286,6 +7193,156 @@ void annotateGameObjects()
 		}
 
     } /* end for */
+	free(label);
+}
+
+
+/*
+------------------------------------------------------------------------------
+Check if a block place is better than another, less clash wins and then being
+nearer the preferred place
+
+*/
+static int Place_better(int overlap, Point p, int best_overlap, Point best,
+                        Point prefer)
+{
+    if (overlap != best_overlap) {
+        return overlap < best_overlap;
+    }
+    return (p.x - prefer.x) * (p.x - prefer.x) + (p.y - prefer.y) * (p.y - prefer.y) <
+        (best.x - prefer.x) * (best.x - prefer.x) + 
+        (best.y - prefer.y) * (best.y - prefer.y);
+}
+
+
+/* Place_area
+------------------------------------------------------------------------------
+Get the area the top left corner of a block may take. Where the block is too
+big for the map along an axis the area has no room along it, so it 
+collapses to the preferred corner rather than reaching off the map
+
+*/
+Box Place_area(int min_x, int min_y, int max_x, int max_y, Point prefer)
+{
+    Box area;
+
+    area.min_x = (max_x < min_x) ? prefer.x : min_x;
+    area.max_x = (max_x < min_x) ? prefer.x : max_x;
+    area.min_y = (max_y < min_y) ? prefer.y : min_y;
+    area.max_y = (max_y < min_y) ? prefer.y : max_y;
+    return area;
+}
+
+
+/* placeBlock
+------------------------------------------------------------------------------
+Find a low clash place for a block of map furniture, the title, legend and 
+the like, with its top left corner somewhere in the area. Anchors every 
+PLACE_STEP pixels over the area are scored against the box manager and the 
+best few refined by a hill climb that halves its step each time it stops 
+improving, so a large map costs thousands of overlap queries rather than one
+per pixel. Ties go to the place nearest the preferred corner
+
+Return:
+ block box at the place found
+
+*/
+Box placeBlock(int width, int height, Box area, Point prefer)
+{
+    Point keep[PLACE_KEEP];
+    int keep_overlap[PLACE_KEEP];
+    int num_keep = 0;
+    Point p;
+    Point next;
+    Point best;
+    int best_overlap = INT_MAX;
+    int overlap;
+    int step;
+    int moved;
+    int i,
+        k,
+        dx,
+        dy;
+
+    prefer.x = MIN(MAX(prefer.x, area.min_x), area.max_x);
+    prefer.y = MIN(MAX(prefer.y, area.min_y), area.max_y);
+
+    /* coarse pass keeping the best anchors, once the list is full anchors 
+     * clashing more than the worst kept are given up on early
+     */
+    for (p.y = area.min_y; ; p.y = MIN(p.y + PLACE_STEP, area.max_y)) {
+        for (p.x = area.min_x; ; p.x = MIN(p.x + PLACE_STEP, area.max_x)) {
+            overlap = BoxMgr_labelOverlap(NULL, 
+                                          Box_boxInt(p.x, p.y, p.x + width, 
+                                                     p.y + height),
+                                          Box_boxInt(0, 0, 0, 0), 0.0,
+                                          num_keep < PLACE_KEEP ? INT_MAX : 
+                                          keep_overlap[num_keep - 1] + 1);
+            if (num_keep < PLACE_KEEP || 
+                Place_better(overlap, p, keep_overlap[num_keep - 1], 
+                             keep[num_keep - 1], prefer)) {
+                k = (num_keep < PLACE_KEEP) ? num_keep++ : num_keep - 1;
+                while (k > 0 && Place_better(overlap, p, keep_overlap[k - 1],
+                                             keep[k - 1], prefer)) {
+                    keep[k] = keep[k - 1];
+                    keep_overlap[k] = keep_overlap[k - 1];
+                    k--;
+                }
+                keep[k] = p;
+                keep_overlap[k] = overlap;
+            }
+            if (p.x == area.max_x) {
+                break;
+            }
+        }
+        if (p.y == area.max_y) {
+            break;
+        }
+    }
+
+    /* refine each kept anchor
+     */
+    best = keep[0];
+    for (i = 0; i < num_keep; i++) {
+        p = keep[i];
+        overlap = keep_overlap[i];
+        for (step = PLACE_STEP / 2; step > 0; ) {
+            moved = FALSE;
+            for (dy = -step; dy <= step; dy += step) {
+                for (dx = -step; dx <= step; dx += step) {
+                    int next_overlap;
+
+                    next.x = MIN(MAX(p.x + dx, area.min_x), area.max_x);
+                    next.y = MIN(MAX(p.y + dy, area.min_y), area.max_y);
+                    if (next.x == p.x && next.y == p.y) {
+                        continue;
+                    }
+                    next_overlap = 
+                        BoxMgr_labelOverlap(NULL, 
+                                            Box_boxInt(next.x, next.y, 
+                                                       next.x + width,
+                                                       next.y + height),
+                                            Box_boxInt(0, 0, 0, 0), 0.0,
+                                            overlap + 1);
+                    if (Place_better(next_overlap, next, overlap, p, prefer)) {
+                        p = next;
+                        overlap = next_overlap;
+                        moved = TRUE;
+                    }
+                }
+            }
+            if (!moved) {
+                step /= 2;
+            }
+        }
+        if (Place_better(overlap, p, best_overlap, best, prefer)) {
+            best = p;
+            best_overlap = overlap;
+        }
+    }
+    if (verbose) printf("placed block at     %d,%d clash %d\n", best.x, best.y,
+                        best_overlap);
+    return Box_boxInt(best.x, best.y, best.x + width, best.y + height);
 }
 
 
@@ -2296,54 +7353,32 @@ Draw map title
 */
 void drawTitle()
 {
-    int temp_x=0;
-    int temp_y=0;
     int title_width=0;
     int title_height=0;
-    int min_overlaps;
-    int overlaps;
-    int box_num=0;
-    int title_x=0;
-    int title_y=0;
-    Box temp_box = { min_x = 0, min_y = 0, max_x = 0, max_y = 0 };
-    Box title_box = { min_x = 0, min_y = 0, max_x = 0, max_y = 0 };
-
-    /* Find best place to write the title at the top of the map 
+    Point prefer;
+    Box title_box;
+
+    /* Find best place to write the title, preferring the top left of the map
      */
     if (verbose) printf("Drawing title\n");
     title_height = ((gdFont *) gdFontGiant)->h;
     title_width = ((gdFont *) gdFontGiant)->w * strlen(title);
-    min_overlaps = INT_MAX;
-    title_x = 0;
-    title_y = 0;
-    for (temp_y = title_height / 2; 
-         temp_y < (im_out->sy - title_height * 1.5); 
-         temp_y += title_height / 2) {
-        for (temp_x = ((gdFont *) gdFontGiant)->w; 
-             (temp_x + title_width + ((gdFont *) gdFontGiant)->w) < im_out->sx; 
-             temp_x++) {
-
-            overlaps = 0;
-            temp_box = Box_boxInt(temp_x,temp_y,temp_x + title_width,
-                                  temp_y + ((gdFont *) gdFontGiant)->h);
-            for (box_num = 0; box_num < BoxMgr_numberBoxes(); box_num++) {
-                overlaps += Box_overlap(BoxMgr_get(box_num),temp_box);
-            }
-            if (overlaps < min_overlaps) {
-                min_overlaps = overlaps;
-                title_x = temp_x;
-                title_y = temp_y;
-                title_box = temp_box;
-            }
-        }
-    }
+    prefer.x = ((gdFont *) gdFontGiant)->w;
+    prefer.y = title_height / 2;
+    title_box = placeBlock(title_width, title_height,
+                           Place_area(prefer.x, prefer.y,
+                                      im_out->sx - title_width - 
+                                      ((gdFont *) gdFontGiant)->w - 1,
+                                      im_out->sy - (title_height * 3) / 2 - 1,
+                                      prefer),
+                           prefer);
     
     /* Having found a good place for the title, write it 
      */
     if (background) {
         fadeBox(im_out, title_box, TITLE_FADE);
     }
-    gdImageString(im_out, gdFontGiant, title_x, title_y, title, 
+    gdImageString(im_out, gdFontGiant, title_box.min_x, title_box.min_y, title, 
 				  title_text_color);
     BoxMgr_add(Box_dilate(title_box,TEXT_DILATION));    
 }
@@ -2360,10 +7395,12 @@ void drawLegend ()
     int max_text_w;
     int max_image_r;
     int total_h;
+    int legend_w;
     int legend_x;
     int legend_y;
     int ypos;
-    Box temp_box;
+    Point prefer;
+    Box legend_box;
 
     /* Estimate size of legend 
      */
@@ -2380,43 +7417,34 @@ void drawLegend ()
                        ((gdFont *) gdFontSmall)->h);
     }
     max_text_w++;
+    legend_w = (max_image_r * 2) + max_text_w * ((gdFont *) gdFontSmall)->w;
     
-    /* Find a good place to put the legend 
-     * for the moment, assume the top right 
+    /* Find a good place to put the legend clear of the game objects, labels
+     * and title, preferring the top right 
      */
-    legend_x = im_out->sx - ((max_image_r * 2) + max_text_w * 
-                             ((gdFont *) gdFontSmall)->w) - 15;
-    legend_y = 30;
+    if (verbose) printf("drawing legend\n");
+    prefer.x = im_out->sx - legend_w - LEGEND_MARGIN;
+    prefer.y = LEGEND_TOP;
+    legend_box = placeBlock(legend_w, total_h, 
+                            Place_area(LEGEND_MARGIN, LEGEND_TOP, prefer.x,
+                                       im_out->sy - total_h - LEGEND_TOP, prefer),
+                            prefer);
+    legend_x = legend_box.min_x;
+    legend_y = legend_box.min_y;
     
     /* Draw Legend 
      */
-    if (verbose) printf("drawing legend\n");
     if (background) {
-        temp_box = Box_boxInt(legend_x, legend_y,
-                              legend_x + ((max_image_r * 2) + max_text_w * 
-                                          ((gdFont *) gdFontSmall)->w),
-                              legend_y + total_h);
-        fadeBox(im_out,temp_box,LEGEND_FADE);
-    }
-    gdImageRectangle(im_out, legend_x, legend_y,
-                     legend_x + (max_image_r * 2) + max_text_w * 
-                     ((gdFont *) gdFontSmall)->w,
+        fadeBox(im_out,legend_box,LEGEND_FADE);
+    }
+    gdImageRectangle(im_out, legend_x, legend_y, legend_x + legend_w,
                      legend_y + total_h, legend_color);
     for (index_num = 0, ypos = legend_y; index_num < num_indexed_classes;
          index_num++) {
 
-		/* change foreground color 
-		 */
-		if (color && foreground_color != NOT_DEFINED) {
-			changeForeground
-				(class[index_class[index_num]].image[3]);
-		}
-        gdImageCopy(im_out, class[index_class[index_num]].image[3],
-                    legend_x + max_text_w * 
-                    ((gdFont *) gdFontSmall)->w + max_image_r - 
-                    class[index_class[index_num]].radius, ypos, 0, 0,
-                    class[index_class[index_num]].radius * 2, 
-                    class[index_class[index_num]].radius * 2);
+        Sprite_draw(im_out, class[index_class[index_num]].sprite[3],
+                    legend_x + max_text_w * ((gdFont *) gdFontSmall)->w + 
+                    max_image_r, ypos + class[index_class[index_num]].radius);
         gdImageString(im_out, gdFontSmall, legend_x + (max_text_w - 
                        strlen(class[index_class[index_num]].name))
                       * ((gdFont *) gdFontSmall)->w,
@@ -2426,6 +7454,7 @@ void drawLegend ()
         ypos += MAX(class[index_class[index_num]].radius * 2, 
                     ((gdFont *) gdFontSmall)->h);
     }
+    BoxMgr_add(Box_dilate(legend_box,TEXT_DILATION));    
 }
 
 
@@ -2436,12 +7465,22 @@ Create empty map image and default palette
 */
 void createImage()
 {
+    int i;
+
     /* Create map image first color allocated is the background color so
      * allocate according to color or bitonal. Allocate other map colors
      * according to color or bitonal map
      */
     im_out = gdImageCreate(out_x, out_y);
 
+    /* gd leaves the unallocated palette entries unset but writes them to the
+     * gif up to the next power of two, clear them so a map is the same bytes 
+     * run to run
+     */
+    for (i = 0; i < gdMaxColors; i++) {
+        im_out->red[i] = im_out->green[i] = im_out->blue[i] = 0;
+    }
+
     /* Read the color data from the resource file and allocate them in the image
 	 * palette
 	 */
@@ -2533,6 +7572,36 @@ void writeImage()
 }
 
 
+#ifdef FTMAP_PREP
+/*
+******************************************************************************
+ftmap-prep main program, reads the header and class sections of a data file 
+and packs all twelve headings of every class into one sprite pack, made with
+the -a, -b and resource file settings the maps will use
+
+******************************************************************************
+*/
+int main(int argc, char* argv[])
+{
+    int class_num;
+    int heading;
+
+    getArgs(argc,argv);
+    fprintf(stdout,"%s-prep v%s\n",PROGRAM, VERSION);
+    fprintf(stdout,"%s\n\n",COPYRIGHT);
+
+    readHeader();
+    loadGameImages();
+    for (class_num = 0; class_num < num_classes; class_num++) {
+        for (heading = 0; heading < 12; heading++) {
+            useSprite(class_num, heading);
+        }
+    }
+    prepareGameImages();
+    Pack_write(gif_filename ? gif_filename : "ftmap.pak");
+    return 0;
+}
+#else
 /*
 ******************************************************************************
 ftmap main program
@@ -2554,13 +7623,25 @@ int main(int argc, char* argv[])
      */
     readHeader();
 	
-    /* Load the game object images
+    /* Load the game object classes, just checking the sprite rotation if 
+     * asked
      */
     loadGameImages();
+    if (check_spin) {
+        prepareGameImages();
+        printf("sprite rotation check %d probes, %d differ, %d at rounding ties\n", 
+               spin_probes, spin_differ, spin_ties);
+        printf("sprite rotation kernel %s, %d pixels differ from scalar\n", 
+               spin_kernel, spin_kernel_differ);
+        printf("sprite headings %d pixels differ from the original rotation, %d at rounding ties\n", 
+               spin_pixels, spin_tie_pixels);
+        exit(spin_differ || spin_kernel_differ || spin_pixels ? 1 : 0);
+    }
     
-    /* Load the game object data
+    /* Load the game object data then the images of the classes in use
      */
     loadGameObjects();
+    prepareGameImages();
 	
 	/* Create map image from resources file colors
      */
@@ -2570,6 +7651,10 @@ int main(int argc, char* argv[])
      */
     setStyles();
 
+    /* Create the text clash box manager for the map
+     */
+    BoxMgr_init(out_x, out_y);
+
    /* Copy background image to map image
     */
     if (background) {
@@ -2585,15 +7670,16 @@ int main(int argc, char* argv[])
 	 * see against it. Do all the fading first otherwise the game object images
      * will be unintentionally modified. Then draw the game object images and 
 	 * tracking lines and annotate the game objects so that the text doesn't 
-     * overlap
+     * overlap. Sprite foregrounds are changed once before any are drawn
      */
+    recolorSprites();
 	if (background) {
 		fadeGameObjects();
 	}
     drawGameObjects();
     annotateGameObjects();  
 
-    /* Draw the map title and optional legend doing minimal clash detection
+    /* Draw the map title and optional legend where they clash least
      */
     drawTitle();
     if (legend) {
@@ -2604,15 +7690,6 @@ int main(int argc, char* argv[])
      */
     writeImage();
 }
+#endif
 
 /******************************************************************************/
-
-
-
-
-
-
-
-
-
-
@@ -6,5 +6,40 @@
 ./ftmap -i ex_img -f example5.gif < example.ft
 ./ftmap -a -l -g -r ftmap.ini -i ex_img -f example6.gif < example2.ft
 ./ftmap -a -r omit.ini -i ex_img -f example7.gif < example2.ft
+# checks the sprite rotation kernel and the finished headings against the 
+# original polar rotation, with and without resampling
+./ftmap --check-spin -r ftmap.ini -i ex_img < example2.ft || echo "**** sprite rotation check failed"
+./ftmap --check-spin -a -r ftmap.ini -i ex_img < example2.ft || echo "**** sprite rotation check with -a failed"
+./ftmap --check-spin -i ex_img < example.ft || echo "**** sprite rotation check of example failed"
 # tests debug mode - generates test sprites
-# ./ftmap - -r ftmap.ini -i ex_img -f example8.gif < example2.ft
\ No newline at end of file
+# ./ftmap - -r ftmap.ini -i ex_img -f example8.gif < example2.ft
+
+# sprite cache, a cold run fills the cache and a warm run reads it back, 
+# both must draw example6 exactly
+cache_dir=$(mktemp -d)
+./ftmap -a -l -g -r ftmap.ini -i ex_img --sprite-cache $cache_dir -f $cache_dir/cold.gif < example2.ft
+./ftmap -a -l -g -r ftmap.ini -i ex_img --sprite-cache $cache_dir -f $cache_dir/warm.gif < example2.ft
+cmp -s example6.gif $cache_dir/cold.gif || echo "**** sprite cache cold run differs from example6"
+cmp -s example6.gif $cache_dir/warm.gif || echo "**** sprite cache warm run differs from example6"
+rm -rf $cache_dir
+
+# sprite pack round trip, ftmap-prep packs the example2 classes and example6 
+# drawn from the pack must match the one drawn from the gifs
+pack_dir=$(mktemp -d)
+./ftmap-prep -a -r ftmap.ini -i ex_img -f $pack_dir/example2.pak < example2.ft
+./ftmap -a -l -g -r ftmap.ini -i ex_img -p $pack_dir/example2.pak -f $pack_dir/packed.gif < example2.ft
+cmp -s example6.gif $pack_dir/packed.gif || echo "**** sprite pack map differs from example6"
+rm -rf $pack_dir
+
+# tints, example2 with a tint line on each game object, on a bitonal map the 
+# tints are ignored so it must draw as without them, on a colour map the 
+# tints must show
+tint_dir=$(mktemp -d)
+awk 'stars == 1 && $0 != "*" { print; if (++n % 8 == 0) print "tint 255 60 60"; next }
+     $0 == "*" { stars++ } { print }' example2.ft > $tint_dir/tint.ft
+./ftmap -a -b -l -g -i ex_img -f $tint_dir/plain.gif < example2.ft
+./ftmap -a -b -l -g -i ex_img -f $tint_dir/bitonal.gif < $tint_dir/tint.ft
+./ftmap -a -l -g -r ftmap.ini -i ex_img -f $tint_dir/tinted.gif < $tint_dir/tint.ft
+cmp -s $tint_dir/plain.gif $tint_dir/bitonal.gif || echo "**** tinted bitonal map differs from the untinted one"
+cmp -s example6.gif $tint_dir/tinted.gif && echo "**** tinted map is the same as example6"
+rm -rf $tint_dir